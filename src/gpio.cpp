@@ -6,32 +6,76 @@
 #include <gpiod.h>
 #include "vito_io.h"
 #include "restapi.h"
+#include "reactor.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include <atomic>
 
 static struct gpiod_line_bulk gpios;
 static const int MAXLINE = 64;
+static const int EVENTBATCH = 16;       ///< Events read per line and wakeup
+static const int MAXSLOT = 1024;        ///< Slots of the persistent counter file
 static DebounceFilter debounceFilter[MAXLINE];
+static std::vector<CacheEntry*> lineTargets[MAXLINE];  ///< Entries fed by each line
+static std::vector<CacheEntry*> frequencies;           ///< Frequency entries subject to decay
+static const uint64_t NSEC = 1000000000ull;
+static const int WINDOW = 16;                           ///< Edges kept for the frequency estimate
+static const uint64_t WINDOW_NS = 60 * NSEC;            ///< Older edges are dropped as long as two remain
+/**
+ * Recent accepted edges of a line.
+ */
+struct EdgeWindow {
+    uint64_t edges[WINDOW];     // event times in nanoseconds
+    uint8_t head;               // next write position
+    uint8_t count;
+    uint64_t seen;              // monotonic time the last edge was processed
+};
+static EdgeWindow windows[MAXLINE];
+static int32_t* counters;       ///< Mapped counter file
+static size_t countersSize;
+static std::atomic<bool> countersDirty;     ///< Set by the GPIO thread, cleared by gpio_sync
+static int countersSync;
+static time_t countersDue;
 
-int gpio_init()
+int gpio_counters(const char* file, int sync)
 {
-    struct gpiod_chip* chip;
-    struct gpiod_line* line;
-
-    chip = gpiod_chip_open("/dev/gpiochip0");
-    if (chip == 0) return logText(0, "io", "Error opening chip");
-
-    gpiod_line_bulk_init(&gpios);
-
-    uint64_t mask = 0;
+    int slots = 0;
+    CacheEntry* owner[MAXSLOT] = {};
     for (auto io = gpioList.begin(); io != gpioList.end(); io++) {
-        if ((mask & (1 << (*io)->addr)) == 0) {
-            line = gpiod_chip_get_line(chip, (*io)->addr);
-            if (line == 0) logText(0, "io", "Error opening line %d\n", 17);
-            else gpiod_line_bulk_add(&gpios, line);
-            mask |= 1 << (*io)->addr;
+        int offset = (*io)->offset;
+        if (offset < 0) continue;
+        if (offset >= MAXSLOT || owner[offset]) {
+            logText(0, "io", "Counter %s: offset %d %s, not persisted", (*io)->path, offset, offset >= MAXSLOT ? "out of range" : "already used");
+            (*io)->offset = -1;
+            continue;
         }
+        owner[offset] = *io;
+        if (offset >= slots) slots = offset + 1;
+    }
+    if (slots == 0) return 0;
+    countersSize = slots * sizeof(int32_t);
+    int fd = open(file, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || ((size_t)st.st_size < countersSize && ftruncate(fd, countersSize) < 0)) {
+        if (fd >= 0) close(fd);
+        return logText(0, "io", "Error opening %s %s", file, strerror(errno));
+    }
+    void* map = mmap(0, countersSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return logText(0, "io", "Error mapping %s %s", file, strerror(errno));
+    counters = (int32_t*)map;
+    countersSync = sync;
+    countersDue = time(0) + sync;
+    for (auto io = gpioList.begin(); io != gpioList.end(); io++) {
+        int offset = (*io)->offset;
+        if (offset < 0) continue;
+        if ((offset + 1) * sizeof(int32_t) <= (size_t)st.st_size) (*io)->value = counters[offset];
+        else counters[offset] = (*io)->value;     // slot added to the file, keep the count restored from the snapshot
     }
-    int status = gpiod_line_request_bulk_falling_edge_events(&gpios, "viserve");
-    if (status) return logText(0, "io", "bulk_register failed %d\n", status);
     return 0;
 }
 
@@ -42,14 +86,14 @@ DebounceFilter* gpio_filter(unsigned int index)
     return &debounceFilter[index];
 }
 /**
- * Returns delta to previous emitted event in milliseconds. First emitted is simplified.
+ * Returns delta to previous emitted event in nanoseconds, zero if the event is suppressed. First emitted is simplified.
  */
-static int debounce(unsigned int line, timespec* timestamp)
+static uint64_t debounce(unsigned int line, const timespec* timestamp)
 {
     if (line >= MAXLINE) return 1;
     auto deb = &debounceFilter[line];
-    uint64_t ts = timestamp->tv_sec * 1000 + timestamp->tv_nsec / 1000000;
-    if (deb->min > 0 && ts - deb->timestamps[0] < deb->min) return 0;          // completely suppress short bounces
+    uint64_t ts = timestamp->tv_sec * NSEC + timestamp->tv_nsec;
+    if (deb->min > 0 && ts - deb->timestamps[0] < deb->min * (NSEC / 1000)) return 0;          // completely suppress short bounces
 
     memmove(&deb->timestamps[1], &deb->timestamps[0], (deb->MAX - 1) * sizeof(deb->timestamps[0]));
     deb->timestamps[0] = ts;
@@ -62,13 +106,13 @@ static int debounce(unsigned int line, timespec* timestamp)
         auto d = deb->timestamps[i] - deb->timestamps[i + 1];
         if (d > max) max = d;
     }
-    auto d0 = (int)(ts - deb->timestamps[1]);
+    uint64_t d0 = ts - deb->timestamps[1];
 
-    logText(4, "io", "%2d filter fill=%d max=%d d0=%d", line, deb->fill, (int)max, d0);
+    logText(4, "io", "%2d filter fill=%d max=%llu d0=%llu", line, deb->fill, (unsigned long long)max, (unsigned long long)d0);
 
     if (deb->fill == deb->MAX) {        // first time report longest
         deb->last = ts;
-        return (int)max;
+        return max;
     }
 
     if (d0 * deb->ratio > max) {        // do only forward events better than ratio
@@ -79,51 +123,146 @@ static int debounce(unsigned int line, timespec* timestamp)
     return 0;
 }
 
-static time_t last;
-void gpio_poll(time_t &now)
+static uint64_t monotonicNs()
 {
-    if (now != last) {
-        //
-        // Adjust frequency in case of slowing or stopping counter
-        //
-        for (auto io = gpioList.begin(); io != gpioList.end(); io++) {
-            if ((*io)->target == GPIO_Frequency && (*io)->addr < MAXLINE && (*io)->lastTs && (*io)->lastTs < now) {
-                int val = (*io)->scale / (now - (*io)->lastTs);
-                if (val < (*io)->value) {
-                    logText(4, "io", "%2d timeout %d : %d", (*io)->addr, (int)now, (int)(*io)->lastTs);
-                    logText(4, "io", "%2d timeout %s %d => %d", (*io)->addr, (*io)->name, (*io)->value, val);
-                    (*io)->value = val;
-                }
-            }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+/**
+ * Add an accepted edge to the window of the line and estimate the frequency in Hz
+ * as edges per elapsed time across the window. The period reported by the filter
+ * is used until two edges are known.
+ */
+static double estimate(EdgeWindow* w, uint64_t ts, uint64_t period)
+{
+    w->edges[w->head] = ts;
+    w->head = (w->head + 1) % WINDOW;
+    if (w->count < WINDOW) w->count++;
+    w->seen = monotonicNs();
+    auto oldest = [w]() { return w->edges[(w->head + WINDOW - w->count) % WINDOW]; };
+    while (w->count > 2 && ts - oldest() > WINDOW_NS) w->count--;     // forget edges of a different rate
+    if (w->count < 2 || ts == oldest()) return (double)NSEC / period;
+    return (w->count - 1) * (double)NSEC / (ts - oldest());
+}
+
+/**
+ * Publish a new value to the http threads.
+ */
+static void storeValue(CacheEntry* ce, int32_t value)
+{
+    __atomic_store_n(&ce->value, value, __ATOMIC_RELEASE);
+    touchCacheEntry(ce);
+}
+
+/**
+ * Once a second housekeeping: decay the frequency of slowing or stopped counters.
+ * The time since the last edge is a lower bound of the current period.
+ */
+static void onSecond(time_t now)
+{
+    uint64_t mono = monotonicNs();
+    for (auto io = frequencies.begin(); io != frequencies.end(); io++) {
+        EdgeWindow* w = &windows[(*io)->addr];
+        if (w->count == 0 || mono <= w->seen) continue;
+        int32_t val = (int32_t)((*io)->scale * (double)NSEC / (mono - w->seen));
+        if (val < (*io)->value) {
+            logText(4, "io", "%2d timeout %s %d => %d", (*io)->addr, (*io)->name, (*io)->value, val);
+            storeValue(*io, val);
         }
-        last = now;
     }
-    struct timespec ts = { 0, 999000000 };
-    gpiod_line_bulk bulkev;
-    int rv = gpiod_line_event_wait_bulk(&gpios, &ts, &bulkev);
-    if (rv > 0) {
-        logText(5, "io", "%d events received", bulkev.num_lines);
-        for (int i = 0; i < bulkev.num_lines; i++) {
-            struct gpiod_line_event event;
-            rv = gpiod_line_event_read(bulkev.lines[i], &event);
-            if (rv == 0) {
-                int no = gpiod_line_offset(bulkev.lines[i]);
-                int ms = debounce(no, &event.ts);
-                logText(3, "io", "%2d d=%d", no, ms);
-                if (ms > 0) {
-                    for (auto io = gpioList.begin(); io != gpioList.end(); io++) {
-                        if (no == (*io)->addr) {
-                            if ((*io)->target == GPIO_Counter) (*io)->value++;              // increment
-                            else {
-                                (*io)->value = (*io)->scale * 1000 / ms;         // estimate frequency
-                            }
-                            logText(4, "io", "%2d update %s => %d", no, (*io)->name, (*io)->value);
-                            (*io)->lastTs = now;
-                        }
-                    }
-                }
+}
+
+void gpio_sync()
+{
+    time_t now = time(0);
+    if (!counters || now < countersDue || !countersDirty.exchange(false)) return;     // batch writes to the storage
+    countersDue = now + countersSync;
+    msync(counters, countersSize, MS_SYNC);
+}
+
+/**
+ * Update the entries of a line for a debounced edge.
+ */
+static void onEdge(int no, uint64_t ts, uint64_t period)
+{
+    double hz = -1;
+    for (auto io = lineTargets[no].begin(); io != lineTargets[no].end(); io++) {
+        if ((*io)->target == GPIO_Counter) {
+            int32_t value = (*io)->value + 1;      // increment, only this thread writes
+            if (counters && (*io)->offset >= 0) {
+                counters[(*io)->offset] = value;
+                countersDirty = true;
             }
+            storeValue(*io, value);
+        }
+        else {
+            if (hz < 0) hz = estimate(&windows[no], ts, period);
+            storeValue(*io, (int32_t)((*io)->scale * hz + 0.5));
+        }
+        logText(4, "io", "%2d update %s => %d", no, (*io)->name, (*io)->value);
+    }
+}
+
+/**
+ * Read the pending edge events of a line with a single call. Further events
+ * beyond the batch keep the descriptor readable for the next wakeup.
+ */
+static void onEvent(struct gpiod_line* line)
+{
+    struct gpiod_line_event events[EVENTBATCH];
+    int n = gpiod_line_event_read_multiple(line, events, EVENTBATCH);
+    if (n <= 0) return;
+    int no = gpiod_line_offset(line);
+    logText(5, "io", "%2d %d events read", no, n);
+    for (int i = 0; i < n; i++) {
+        uint64_t period = debounce(no, &events[i].ts);
+        logText(3, "io", "%2d d=%lluus", no, (unsigned long long)period / 1000);
+        if (period > 0) onEdge(no, events[i].ts.tv_sec * NSEC + events[i].ts.tv_nsec, period);
+    }
+}
+
+static void onLine(void* line)
+{
+    onEvent((struct gpiod_line*)line);
+}
+
+static void onTick(void*)
+{
+    onSecond(time(0));
+}
+
+int gpio_init()
+{
+    struct gpiod_chip* chip;
+    struct gpiod_line* line;
+
+    chip = gpiod_chip_open("/dev/gpiochip0");
+    if (chip == 0) return logText(0, "io", "Error opening chip");
+
+    gpiod_line_bulk_init(&gpios);
+
+    for (auto io = gpioList.begin(); io != gpioList.end(); io++) {
+        if ((*io)->addr >= MAXLINE) {
+            logText(0, "io", "Line %d of %s not supported", (*io)->addr, (*io)->path);
+            continue;
         }
+        if (lineTargets[(*io)->addr].empty()) {
+            line = gpiod_chip_get_line(chip, (*io)->addr);
+            if (line == 0) logText(0, "io", "Error opening line %d", (*io)->addr);
+            else gpiod_line_bulk_add(&gpios, line);
+        }
+        lineTargets[(*io)->addr].push_back(*io);
+        if ((*io)->target == GPIO_Frequency) frequencies.push_back(*io);
     }
+    int status = gpiod_line_request_bulk_falling_edge_events(&gpios, "viserve");
+    if (status) return logText(0, "io", "bulk_register failed %d\n", status);
 
+    for (unsigned int i = 0; i < gpios.num_lines; i++) {
+        if (reactor_add(gpiod_line_event_get_fd(gpios.lines[i]), onLine, gpios.lines[i])) return -1;
+    }
+    int tick = reactor_timer(onTick, 0);
+    if (tick < 0) return -1;
+    return reactor_arm(tick, monotonicMs() + 1000, 1000);
 }
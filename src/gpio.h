@@ -9,7 +9,7 @@
 struct DebounceFilter
 {
     static const int MAX = 4;
-    uint64_t timestamps[MAX];
+    uint64_t timestamps[MAX];   // in nanoseconds
     uint64_t last;  // timestamp of last sent
     uint16_t min;   // minimum duration in milliseconds
     bool enabled;
@@ -17,12 +17,21 @@ struct DebounceFilter
     uint16_t ratio; // ratio between longest and shortest gap to be accepted
 };
 
+/**
+ * Request the lines of all GPIO entries and register them with the reactor.
+ */
 int gpio_init();
 /**
- * Poll for gpio event. Method blocks up to 100ms in case no events arrive.
+ * Map the persistent counter file and resume all counters with an offset from it.
+ * Slots not yet in the file are seeded with the current counts, e.g. restored from the snapshot.
+ * @param sync Seconds between flushes of changed counters to the file
  */
-void gpio_poll(time_t& now);
-
+int gpio_counters(const char* file, int sync);
+/**
+ * Write changed counters to the file once the sync interval passed. Blocks until written,
+ * hence called by the housekeeping instead of the GPIO thread.
+ */
+void gpio_sync();
 /**
  * Get the gpio filter. 
  * @param index Range zero to 63 supported
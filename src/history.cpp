@@ -0,0 +1,187 @@
+/*
+ * Copyright 2022 Hans Busch
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include "restapi.h"
+#include "history.h"
+#include "tsstore.h"
+#include "vito_io.h"
+#include <string.h>
+#include <time.h>
+#include <mutex>
+#include <list>
+#include <vector>
+
+#define MAXPOINTS 10000     ///< Maximum number of steps served by a single query
+#define DEFAULT_RANGE 86400 ///< Query range in seconds if not given
+#define DEFAULT_POINTS 200  ///< Number of steps if not given
+
+/**
+ * Fixed capacity ring of value changes stored as struct of arrays.
+ * A value holds from its timestamp until the timestamp of the next sample.
+ */
+struct History {
+    uint32_t capacity;
+    uint32_t head;          // next write position
+    uint32_t count;
+    uint32_t* ts;           // seconds since epoch
+    int32_t* value;         // raw value as in CacheEntry::value
+    uint32_t records;       // records of the persistent store
+    TsStore* store;         // persistent store, null if not configured
+};
+static std::mutex historyMutex;    ///< Protects all histories
+static std::list<CacheEntry*> persisted;    ///< Entries with a persistent store to be opened
+
+/**
+ * Samples of a query range preceded by the last sample before the range.
+ */
+struct Samples {
+    std::vector<uint32_t> ts;
+    std::vector<int32_t> value;
+};
+
+History* history_create(CacheEntry* ce, uint32_t capacity, uint32_t records)
+{
+    History* h = (History*)calloc(1, sizeof(History));
+    h->capacity = capacity;
+    h->ts = (uint32_t*)calloc(capacity, sizeof(uint32_t));
+    h->value = (int32_t*)calloc(capacity, sizeof(int32_t));
+    h->records = records;
+    if (records) persisted.push_back(ce);
+    return h;
+}
+
+/**
+ * Change listener appending the new value to the history of the entry.
+ */
+static void onChange(CacheEntry* ce)
+{
+    History* h = ce->history;
+    if (h == 0) return;
+    uint32_t now = (uint32_t)time(0);
+    std::lock_guard<std::mutex> lock(historyMutex);
+    if (h->store) tsstore_append(h->store, now, ce->value);
+    if (h->capacity == 0) return;
+    h->ts[h->head] = now;
+    h->value[h->head] = ce->value;
+    if (++h->head == h->capacity) h->head = 0;
+    if (h->count < h->capacity) h->count++;
+}
+
+void history_init(const char* dir)
+{
+    for (auto ce : persisted) {
+        if (dir == 0) {
+            logText(0, "ts", "No history directory configured for %s", ce->path);
+            continue;
+        }
+        std::string file = std::string(dir) + '/' + ce->path + ".ts";
+        for (size_t i = strlen(dir) + 1; i < file.size(); i++) if (file[i] == '/') file[i] = '.';
+        ce->history->store = tsstore_open(file.c_str(), ce->history->records);
+    }
+    addChangeListener(onChange);
+}
+
+/**
+ * Collect the samples of the range from the memory ring.
+ */
+static void readRing(History* h, uint32_t from, uint32_t to, Samples& s)
+{
+    for (uint32_t k = 0; k < h->count; k++) {
+        uint32_t i = (h->head + h->capacity - h->count + k) % h->capacity;
+        if (h->ts[i] >= to) break;
+        if (h->ts[i] < from && !s.ts.empty()) s.ts.clear(), s.value.clear();
+        s.ts.push_back(h->ts[i]);
+        s.value.push_back(h->value[i]);
+    }
+}
+
+static void printValue(std::string& buf, CacheEntry* ce, double value)
+{
+    char txt[32];
+    buf.append(txt, snprintf(txt, sizeof(txt), ",%g", value / ce->scale));
+}
+
+/**
+ * Downsample the history into steps. Each step reports min, max and the time weighted average
+ * of the values holding during the step. Steps before the first sample are skipped.
+ * The memory ring is used if it covers the range, the persistent store otherwise.
+ */
+static void getHistory(std::string& buf, CacheEntry* ce, uint32_t from, uint32_t to, uint32_t step, uint32_t now)
+{
+    History* h = ce->history;
+    Samples s;
+    {
+        std::lock_guard<std::mutex> lock(historyMutex);
+        uint32_t oldest = (h->head + h->capacity - h->count) % (h->capacity ? h->capacity : 1);
+        if (h->store && (h->count == 0 || h->ts[oldest] > from)) tsstore_read(h->store, from, to, s.ts, s.value);
+        else readRing(h, from, to, s);
+    }
+    uint32_t count = (uint32_t)s.ts.size();
+    char txt[64];
+    buf.append(txt, snprintf(txt, sizeof(txt), "{\"from\":%u,\"to\":%u,\"step\":%u,\"points\":[", from, to, step));
+    bool notFirst = false;
+    uint32_t i = 0;
+    for (uint64_t next = from; next < to; next += step) {     // 64 bit, the last step may pass 2^32
+        uint32_t begin = (uint32_t)next;
+        uint32_t end = to - begin < step ? to : begin + step;
+        while (i + 1 < count && s.ts[i + 1] <= begin) i++;
+        int32_t min = 0, max = 0;
+        double sum = 0;
+        uint32_t duration = 0;
+        bool found = false;
+        for (uint32_t j = i; j < count && s.ts[j] < end; j++) {
+            uint32_t t0 = s.ts[j];
+            uint32_t t1 = j + 1 < count ? s.ts[j + 1] : now;
+            if (t1 <= begin) continue;
+            int32_t v = s.value[j];
+            if (!found || v < min) min = v;
+            if (!found || v > max) max = v;
+            found = true;
+            if (t0 < begin) t0 = begin;
+            if (t1 > end) t1 = end;
+            if (t1 > t0) {
+                sum += (double)v * (t1 - t0);
+                duration += t1 - t0;
+            }
+        }
+        if (!found) continue;
+        if (notFirst) buf += ',';
+        notFirst = true;
+        buf.append(txt, snprintf(txt, sizeof(txt), "[%u", begin));
+        printValue(buf, ce, min);
+        printValue(buf, ce, max);
+        printValue(buf, ce, duration ? sum / duration : (min + (double)max) / 2);
+        buf += ']';
+    }
+    buf += "]}";
+}
+
+MHD_Result onHistory(struct MHD_Connection* connection, CacheEntry* ce)
+{
+    const char* fault = 0;
+    uint32_t now = (uint32_t)time(0);
+    auto arg = [connection](const char* name, uint32_t def) {
+        auto val = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, name);
+        return val ? (uint32_t)strtoul(val, 0, 10) : def;
+    };
+    uint32_t to = arg("to", now);
+    uint32_t from = arg("from", to > DEFAULT_RANGE ? to - DEFAULT_RANGE : 0);
+    uint32_t step = arg("step", (to - from) / DEFAULT_POINTS);
+    if (step == 0) step = 1;
+    if (ce->history == 0) fault = "<html><body>No history configured.</body></html>";
+    else if (from >= to || (to - from) / step > MAXPOINTS) fault = "<html><body>Invalid range.</body></html>";
+    if (fault) {
+        auto response = MHD_create_response_from_buffer(strlen(fault), (void*)fault, MHD_RESPMEM_PERSISTENT);
+        auto ret = MHD_queue_response(connection, ce->history ? MHD_HTTP_BAD_REQUEST : MHD_HTTP_NOT_FOUND, response);
+        MHD_destroy_response(response);
+        return ret;
+    }
+    auto body = std::make_shared<std::string>();
+    getHistory(*body, ce, from, to, step, now);
+    auto response = createResponse(body);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "application/json");
+    auto ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+    return ret;
+}
@@ -0,0 +1,25 @@
+/*
+ * Copyright 2022 Hans Busch
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#pragma once
+#include <stdint.h>
+#include <microhttpd.h>
+
+struct History;
+struct CacheEntry;
+
+/**
+ * Create a ring holding the last capacity changes of a value and optionally a persistent store of records.
+ */
+History* history_create(CacheEntry* ce, uint32_t capacity, uint32_t records);
+
+/**
+ * Open the persistent stores in dir and start recording the value changes of all entries with a history.
+ */
+void history_init(const char* dir);
+
+/**
+ * Handler for GET /api/<path>/history?from=&to=&step= returning min, max and time weighted average per step.
+ */
+MHD_Result onHistory(struct MHD_Connection* connection, CacheEntry* ce);
@@ -2,56 +2,307 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <time.h>
-#include <sys/timeb.h>
 #include <stdarg.h>
+#include <signal.h>
 #include "vito_io.h"
 #include "restapi.h"
 #include <chrono>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <string>
 #include "pugixml/pugixml.hpp"
 #include "gpio.h"
+#include "mqtt.h"
+#include "history.h"
+#include "tsstore.h"
+#include "reactor.h"
+#include "trace.h"
 
 #ifdef _WIN32 
-#  define timeb _timeb
-#  define ftime _ftime
 #  define S_ISREG(x) (x & _S_IFREG)
 int gpio_init() { return -1; }
+int gpio_counters(const char* file, int sync) { return -1; }
+void gpio_sync() {}
 DebounceFilter* gpio_filter(unsigned int index) { return 0; }
-void gpio_poll(time_t& now) {}
+int mqtt_init(const char* host, int port, const char* clientId, const char* prefix, int qos, bool retain, int keepalive) { return -1; }
+TsStore* tsstore_open(const char* file, uint32_t records) { return 0; }
+void tsstore_append(TsStore* store, uint32_t ts, int32_t value) {}
+void tsstore_read(TsStore* store, uint32_t from, uint32_t to, std::vector<uint32_t>& ts, std::vector<int32_t>& value) {}
+int reactor_init() { return -1; }
+int reactor_timer(reactorHandler handler, void* ctx) { return -1; }
+int reactor_arm(int timer, uint64_t deadline, uint32_t period) { return -1; }
+void reactor_run() {}
+int trace_open(const char* file, uint32_t size) { return -1; }
+void trace_frame(TraceDir dir, int addr, int result, const void* data, size_t len) {}
+uint64_t monotonicMs() { return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
 #else
 #endif
 
 
-extern MHD_Result onMetrics(struct MHD_Connection* connection, const char* url, const char* root, restIO readCb);
+extern MHD_Result onMetrics(struct MHD_Connection* connection, const char* url, const char* root);
+extern MHD_Result onStream(struct MHD_Connection* connection, const char* url);
+extern void initStream();
+extern void onStreamTimer();
+extern void stopStreams();
 
+static struct MHD_Daemon* httpd;
+static std::mutex storageMutex;            ///< Protects storageDue
+static std::condition_variable storageSignal;
+static bool storageDue;
+static volatile sig_atomic_t stopRequested;
+
+/**
+ * Storage thread writing the snapshot and the counter file. Woken once a second by the
+ * housekeeping, the file writes may block for long on SD cards.
+ */
+static void storageLoop()
+{
+    std::unique_lock<std::mutex> lock(storageMutex);
+    while (1) {
+        storageSignal.wait(lock, [] { return storageDue; });
+        storageDue = false;
+        lock.unlock();
+        syncSnapshot();
+        gpio_sync();
+        lock.lock();
+    }
+}
+
+/**
+ * Stop serving and exit, the log is written by the exit handler.
+ * Suspended connections are resumed first, libmicrohttpd panics when stopped with any left.
+ */
+static void stop()
+{
+    stopWaiters();
+    stopStreams();
+    MHD_stop_daemon(httpd);
+    exit(0);
+}
+
+/**
+ * Once a second housekeeping on the event thread. Must not block, GPIO events are served by the same thread.
+ */
+static void onTick(void*)
+{
+    if (stopRequested) stop();
+    onRestTimer();
+    onStreamTimer();
+    {
+        std::lock_guard<std::mutex> lock(storageMutex);
+        storageDue = true;
+    }
+    storageSignal.notify_one();
+}
+
+#define LOG_SLOTS 1024      ///< Records buffered for the log writer, power of two
+#define LOG_PAYLOAD 232     ///< Bytes of formatted text or dumped data per record
+#define LOG_BATCH 8192      ///< Bytes written at once while records keep arriving
+
+/**
+ * Log record of the bounded multi producer queue. Callers only copy text or data into a
+ * slot, time formatting, hex conversion and file writes are done by the log writer thread.
+ */
+struct LogRecord {
+    std::atomic<uint32_t> seq;  // position the slot is ready for, see logPut and logWriter
+    int64_t ms;                 // wall clock in milliseconds
+    int addr;                   // address printed before dumped data
+    uint16_t len;
+    bool dump;                  // payload is binary data
+    char prefix[8];
+    uint8_t payload[LOG_PAYLOAD];
+};
+static LogRecord logRing[LOG_SLOTS];
+static std::atomic<uint32_t> logHead;      ///< Next position claimed by a caller
+static std::atomic<uint32_t> logDropped;   ///< Records lost due to a full ring
+static std::atomic<bool> logReady;         ///< Ring prepared by logInit, records before are dropped
+static std::atomic<bool> logIdle;          ///< Writer sleeps until woken by logWake
+static std::atomic<bool> logStop;          ///< Exiting, the writer drains the ring and reports logDone
+static std::atomic<bool> logDone;
+static std::mutex logMutex;                ///< Guards the sleep of the writer against lost wakeups
+static std::condition_variable logSignal;
 static FILE *fdLog;
 static int logLevel;
 static const char* wwwRoot;
 static const char *metricsRoot;
-void printTimestamp(FILE *fd, const char *prefix) {
-    struct timeb time;
-    ftime(&time);
-    char buffer[64];
-    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", localtime(&time.time));
-    fprintf(fd, "\n%s.%03d %s ", buffer, time.millitm, prefix);
+
+/**
+ * Claim the next free slot. Never blocks, returns null if the ring is full.
+ */
+static LogRecord* logClaim(uint32_t& pos)
+{
+    pos = logHead.load(std::memory_order_relaxed);
+    while (1) {
+        LogRecord* r = &logRing[pos & (LOG_SLOTS - 1)];
+        int32_t diff = (int32_t)(r->seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0 && logHead.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) return r;
+        if (diff < 0) {
+            logDropped++;
+            return 0;
+        }
+        if (diff > 0) pos = logHead.load(std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Wake the writer in case it sleeps. Callers only take the mutex once per idle period of the writer.
+ */
+static void logWake()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);     // publish the record before checking for the sleeper
+    if (!logIdle.load(std::memory_order_relaxed)) return;
+    std::lock_guard<std::mutex> lock(logMutex);
+    logIdle = false;
+    logSignal.notify_one();
+}
+
+static void logPut(LogRecord* r, uint32_t pos, const char* prefix)
+{
+    r->ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    strncpy(r->prefix, prefix, sizeof(r->prefix) - 1);
+    r->prefix[sizeof(r->prefix) - 1] = 0;
+    r->seq.store(pos + 1, std::memory_order_release);
+    logWake();
 }
+
 int logText(int level, const char *prefix, const char *fmt, ...) {
-    if (logLevel < level) return -1;
-    printTimestamp(fdLog, prefix);
+    if (logLevel < level || !logReady.load(std::memory_order_acquire)) return -1;
+    uint32_t pos;
+    LogRecord* r = logClaim(pos);
+    if (r == 0) return -1;
     va_list args;
     va_start(args, fmt);
-    vfprintf(fdLog, fmt, args);
+    int n = vsnprintf((char*)r->payload, sizeof(r->payload), fmt, args);
     va_end(args);
-    fflush(fdLog);
+    r->len = n < 0 ? 0 : n < (int)sizeof(r->payload) ? n : sizeof(r->payload) - 1;
+    r->dump = false;
+    logPut(r, pos, prefix);
     return -1;
 }
 void logDump(int level, const char *prefix, int addr, const void *data, size_t size) {
-    if (logLevel < level) return;
-    printTimestamp(fdLog, prefix);
-    if (addr > 0) fprintf(fdLog, "%04x ", addr);
-    uint8_t *d = (uint8_t*)data;
-    while (size-- != 0) fprintf(fdLog, "%02x", *d++);
+    if (logLevel < level || !logReady.load(std::memory_order_acquire)) return;
+    uint32_t pos;
+    LogRecord* r = logClaim(pos);
+    if (r == 0) return;
+    r->len = (uint16_t)(size < sizeof(r->payload) ? size : sizeof(r->payload));
+    memcpy(r->payload, data, r->len);
+    r->addr = addr;
+    r->dump = true;
+    logPut(r, pos, prefix);
+}
+
+static void logFlush(std::string& buf)
+{
+    if (buf.empty()) return;
+    fwrite(buf.data(), 1, buf.size(), fdLog);
+    fflush(fdLog);
+    buf.clear();
+}
+
+/**
+ * Format the queued records in order and write them in batches. Sleeps while the ring is empty.
+ */
+static void logWriter()
+{
+    uint32_t tail = 0;
+    std::string buf;
+    while (1) {
+        LogRecord* r = &logRing[tail & (LOG_SLOTS - 1)];
+        if (r->seq.load(std::memory_order_acquire) != tail + 1) {
+            if (uint32_t dropped = logDropped.exchange(0)) {
+                char txt[64];
+                buf.append(txt, snprintf(txt, sizeof(txt), "\n%u log records dropped", dropped));
+            }
+            logFlush(buf);
+            std::unique_lock<std::mutex> lock(logMutex);
+            logIdle = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (r->seq.load(std::memory_order_acquire) != tail + 1) {
+                if (logStop) {          // drained for exiting, records still arriving are dropped
+                    logIdle = false;
+                    logDone = true;
+                    return;
+                }
+                logSignal.wait_for(lock, std::chrono::seconds(1));     // fatal signal handlers can not notify
+            }
+            logIdle = false;
+            continue;
+        }
+        char txt[64];
+        time_t sec = (time_t)(r->ms / 1000);
+        size_t n = strftime(txt, sizeof(txt), "\n%Y-%m-%d %H:%M:%S", localtime(&sec));
+        buf.append(txt, n);
+        buf.append(txt, snprintf(txt, sizeof(txt), ".%03d %s ", (int)(r->ms % 1000), r->prefix));
+        if (r->dump) {
+            if (r->addr > 0) buf.append(txt, snprintf(txt, sizeof(txt), "%04x ", r->addr));
+            for (int i = 0; i < r->len; i++) buf.append(txt, snprintf(txt, sizeof(txt), "%02x", r->payload[i]));
+        }
+        else buf.append((char*)r->payload, r->len);
+        r->seq.store(tail + LOG_SLOTS, std::memory_order_release);
+        tail++;
+        if (buf.size() >= LOG_BATCH) logFlush(buf);
+    }
+}
+
+/**
+ * Wait until the writer has written all queued records.
+ * Polls instead of notifying, so it can be used from signal handlers.
+ */
+static void logDrain()
+{
+    if (!logReady) return;
+    logStop = true;
+    for (int i = 0; i < 200 && !logDone; i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+}
+
+static void logExit()
+{
+    logText(0, "--", "Exiting");
+    {
+        std::lock_guard<std::mutex> lock(logMutex);
+        logStop = true;
+        logSignal.notify_one();
+    }
+    logDrain();
+}
+
+/**
+ * Write the queued records before dying of a fatal signal.
+ */
+static void onFatal(int sig)
+{
+    logDrain();
+    fprintf(fdLog, "\nFatal signal %d", sig);
     fflush(fdLog);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void onStop(int sig)
+{
+    stopRequested = 1;
+}
+
+/**
+ * Prepare the log ring and start the log writer. Queued records are written at exit and on fatal signals.
+ */
+static void logInit()
+{
+    for (uint32_t i = 0; i < LOG_SLOTS; i++) logRing[i].seq.store(i, std::memory_order_relaxed);
+    logReady.store(true, std::memory_order_release);
+    std::thread(logWriter).detach();
+    atexit(logExit);
+    signal(SIGSEGV, onFatal);
+    signal(SIGABRT, onFatal);
+    signal(SIGFPE, onFatal);
+    signal(SIGILL, onFatal);
+#ifdef SIGBUS
+    signal(SIGBUS, onFatal);
+#endif
+    signal(SIGTERM, onStop);
+    signal(SIGINT, onStop);
 }
 
 #define EMPTY_PAGE "<html><body>File not found</body></html>"
@@ -78,6 +329,7 @@ request_completed_callback(void* cls,
     void** con_cls,
     enum MHD_RequestTerminationCode toe)
 {
+    dropWaiter(connection);
     if (*(uint32_t*)*con_cls == PUT_MAGIC) {
         struct MHD_Response* response = MHD_create_response_from_buffer(0, 0, MHD_RESPMEM_MUST_COPY);
         auto ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
@@ -108,11 +360,14 @@ static MHD_Result onHttp(void *cls,
         return MHD_YES;
     }
 
+    if (get && !strncmp(url, "/api/stream", 11) && (url[11] == 0 || url[11] == '/')) {
+        return onStream(connection, url + 11);
+    }
     if (!strncmp(url, "/api", 4)) {
         return onRestApi(connection, url, !get, upload_data, upload_data_size);
     }
     if (get && !strncmp(url, "/metrics", 8)) {
-        return onMetrics(connection, url, metricsRoot, vito_read);
+        return onMetrics(connection, url, metricsRoot);
     }
     if (!get) return MHD_NO;
 
@@ -151,7 +406,6 @@ static MHD_Result onHttp(void *cls,
 
 int main(int argc, char* const* argv)
 {
-    struct MHD_Daemon* daemon;
     pugi::xml_document doc;
 
     if (!doc.load_file("config.xml")) {
@@ -168,6 +422,7 @@ int main(int argc, char* const* argv)
         fprintf(stderr, "Error: failed to open logfile\n");
         fdLog = stderr;
     }
+    logInit();
     auto _gpios = server.child("gpios");
     for (auto gpio = _gpios.first_child(); gpio; gpio = gpio.next_sibling()) {
         auto no = gpio.attribute("addr").as_uint();
@@ -182,14 +437,31 @@ int main(int argc, char* const* argv)
 
     int port = server.first_element_by_path("http/port").text().as_int();
     int defaultRefresh = server.first_element_by_path("default/refresh").text().as_int(10);
+    int maxBlock = server.first_element_by_path("default/block").text().as_int(32);
+
+    loadRestApi(ApiRoot, doc.first_element_by_path("config/api"), defaultRefresh, maxBlock, vito_read, vito_write, vito_refresh);
+    auto snapshot = server.child("snapshot");
+    if (snapshot) initSnapshot(snapshot.child("path").text().as_string("/var/lib/viserve/cache.bin"), snapshot.child("interval").text().as_int(300));
+    auto counters = server.child("counters");
+    if (counters) gpio_counters(counters.child("path").text().as_string("/var/lib/viserve/counters"), counters.child("sync").text().as_int(60));
+    initStream();
+    history_init(server.first_element_by_path("history/path").text().as_string(0));
+
+    auto mqtt = server.child("mqtt");
+    if (mqtt) {
+        mqtt_init(mqtt.child("host").text().as_string("localhost"), mqtt.child("port").text().as_int(1883),
+            mqtt.child("client").text().as_string("viserve"), mqtt.child("prefix").text().as_string("viserve"),
+            mqtt.child("qos").text().as_int(0), mqtt.child("retain").text().as_bool(true), mqtt.child("keepalive").text().as_int(60));
+    }
 
-    loadRestApi(ApiRoot, doc.first_element_by_path("config/api"), defaultRefresh, vito_read, vito_write);
+    auto trace = server.child("trace");     // before serving, a request starts the I/O worker writing the trace
+    if (trace) trace_open(trace.child("path").text().as_string("/var/lib/viserve/wire.trace"), trace.child("size").text().as_uint(1 << 20));
 
-    daemon = MHD_start_daemon(MHD_USE_DEBUG | MHD_USE_INTERNAL_POLLING_THREAD,
+    httpd = MHD_start_daemon(MHD_USE_DEBUG | MHD_USE_INTERNAL_POLLING_THREAD | MHD_ALLOW_SUSPEND_RESUME,
         port, NULL, NULL, &onHttp, NULL,
         MHD_OPTION_CONNECTION_TIMEOUT, 256, MHD_OPTION_NOTIFY_COMPLETED, &request_completed_callback, NULL, MHD_OPTION_END);
 
-    logText(0, "--", "http daemon listen on %d", daemon ? port : -1);
+    logText(0, "--", "http daemon listen on %d", httpd ? port : -1);
 
     auto usbPort = server.first_element_by_path("usb").text().as_string(0);
     if (usbPort) {
@@ -201,25 +473,19 @@ int main(int argc, char* const* argv)
             vito_init();
         }
     }
-    if (gpioList.size() > 0) {
-        gpio_init();
-        time_t last = 0;
-        while (1) {
-            time_t now = time(0);
-            if (now != last) {      // once a second
-                onRestTimer();
-                last = now;
-            }
-            gpio_poll(now);
-        }
+    startRestRefresh();
+    std::thread(storageLoop).detach();
+    if (reactor_init() == 0) {
+        startPulseTimer();
+        if (gpioList.size() > 0) gpio_init();
+        int tick = reactor_timer(onTick, 0);
+        if (tick >= 0 && reactor_arm(tick, monotonicMs() + 1000, 1000) == 0) reactor_run();
+        logText(0, "--", "Event loop failed, exiting");     // pulses and GPIO can not be served any more
+        return 1;
     }
-    else {
-        while (1) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-            onRestTimer();
-        }
+    if (gpioList.size() > 0) logText(0, "--", "No event loop, GPIO not monitored");
+    while (1) {         // platforms without epoll, pulses are switched off by the housekeeping
+        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+        onTick(0);
     }
-    MHD_stop_daemon(daemon);
-
-    return 0;
 }
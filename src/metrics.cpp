@@ -4,41 +4,48 @@
  */
 #include "restapi.h"
 #include <time.h>
-#include <sstream>
+#include <string>
 #include <list>
+#include <mutex>
 
-static time_t now;
 #define MAX_BUF 2048
+
+/**
+ * Scrape output memoized with the version of the root it was rendered for.
+ */
+static struct {
+    CacheEntry* root;
+    uint32_t version;
+    std::shared_ptr<const std::string> body;    // immutable, shared with responses in flight
+} metricsCache;
+static std::mutex metricsMutex;             ///< Protects metricsCache
 /**
   * Recursively convert a cache entry to Json.
   */
-static bool getMetrics(std::stringstream& buf, CacheEntry* ce, char* jpath, char* jcur, char* jmax, restIO readCb)
+static bool getMetrics(std::string& buf, CacheEntry* ce, char* jpath, char* jcur, char* jmax)
 {
     jcur += snprintf(jcur, jmax - jcur, "_%s", ce->name);
 
     if (ce->children) {
         bool notFirst = false;
         for (CacheEntry* c = ce->children; c->name; c++) {
-            getMetrics(buf, c, jpath, jcur, jmax, readCb);
+            getMetrics(buf, c, jpath, jcur, jmax);
         }
         return true;
     }
     else if (ce->op != Writeonly) {
-        if (ce->target == Vito && ce->timeout < now) {
-            readCb(ce->addr, ce->buffer, ce->len);
-            if (ce->len == 2) ce->value = ce->val16;        // propagate sign
-            ce->timeout = now + ce->refresh;
-        }
-        buf << "# TYPE " << jpath << " gauge\n" << jpath << ' ';
+        if (ce->block && ce->updated == 0) return false;      // not read from the device so far
+        buf.append("# TYPE ").append(jpath).append(" gauge\n").append(jpath).append(1, ' ');
+        char txt[32];
         switch (ce->type) {
         case Bool:
-            buf << (ce->value ? '1' : '0');
+            buf.append(1, loadValue(ce) ? '1' : '0');
             break;
         default:
-            buf << (ce->value / (double)ce->scale);
+            buf.append(txt, snprintf(txt, sizeof(txt), "%g", loadValue(ce) / (double)ce->scale));
             break;
         }
-        buf << '\n';
+        buf.append(1, '\n');
         return true;
     }
     return false;
@@ -48,9 +55,9 @@ static bool getMetrics(std::stringstream& buf, CacheEntry* ce, char* jpath, char
 /**
  * Handler for serving OpenMetrics GET scrape calls.
  */
-MHD_Result onMetrics(struct MHD_Connection *connection, const char *url, const char* root, restIO readCb)
+MHD_Result onMetrics(struct MHD_Connection *connection, const char *url, const char* root)
 {
-    CacheEntry *ce = lookup(root, ApiRoot);
+    CacheEntry *ce = lookup(root);
     if (!ce) {
         const char* fault = "<html><body>Resource not found</body></html>";
         auto response = MHD_create_response_from_buffer(strlen(fault), (void*)fault, MHD_RESPMEM_PERSISTENT);
@@ -58,13 +65,21 @@ MHD_Result onMetrics(struct MHD_Connection *connection, const char *url, const c
         MHD_destroy_response(response);
         return ret;
     }
-	std::stringstream sbuf;
-    now = time(0);
-	char buffer[MAX_BUF] = "vito";     ///< Must be larger than longest possible path.
-    getMetrics(sbuf, ce, buffer, buffer + strlen(buffer), buffer + sizeof(buffer), readCb);
+    for (uint32_t i = ce->slots[0]; i < ce->slots[1]; i++) fetchCacheEntry(leafAt(i));
+    uint32_t version = nodeVersion(ce);
+    std::shared_ptr<const std::string> body;
+    {
+        std::lock_guard<std::mutex> lock(metricsMutex);
+        if (!metricsCache.body || metricsCache.root != ce || metricsCache.version != version) {
+            auto text = std::make_shared<std::string>();
+            char buffer[MAX_BUF] = "vito";     ///< Must be larger than longest possible path.
+            getMetrics(*text, ce, buffer, buffer + strlen(buffer), buffer + sizeof(buffer));
+            metricsCache = { ce, version, text };
+        }
+        body = metricsCache.body;
+    }
 
-    struct MHD_Response * response = MHD_create_response_from_buffer(sbuf.str().length(),
-        (void*)sbuf.str().c_str(), MHD_RESPMEM_MUST_COPY);
+    struct MHD_Response * response = createResponse(body);
     auto ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
     MHD_destroy_response(response);
 
@@ -0,0 +1,329 @@
+/*
+ * Copyright 2022 Hans Busch
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include "mqtt.h"
+#include "restapi.h"
+#include "vito_io.h"
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <string>
+#include <set>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+
+#define BATCH_DELAY 50      ///< Milliseconds changes are collected before publishing
+#define IO_TIMEOUT 5000     ///< Milliseconds granted for connecting and sending
+#define RECONNECT_DELAY 5   ///< Seconds between connection attempts
+#define MAX_INFLIGHT 1024   ///< Maximum number of unacknowledged QoS 1 publishes kept for resending
+
+enum MqttPacket {
+    CONNECT = 0x10,
+    CONNACK = 0x20,
+    PUBLISH = 0x30,
+    PUBACK = 0x40,
+    PINGREQ = 0xc0
+};
+#define DUP 0x08            ///< Flag of a PUBLISH sent again
+
+/**
+ * QoS 1 publish sent but not yet acknowledged by the broker.
+ */
+struct Inflight {
+    uint16_t id;
+    std::string packet;
+};
+
+static std::string host, clientId, prefix;
+static int port, qos, keepalive;
+static bool retain;
+static int fd = -1;
+static uint16_t packetId;
+static std::list<Inflight> inflight;        ///< Unacknowledged publishes in send order, publisher thread only
+static std::string received;                ///< Incomplete packet received from the broker
+
+static std::set<CacheEntry*> pending;       ///< Changed values not yet published
+static bool republish;                      ///< Publish all values after (re)connect
+static std::mutex pendingMutex;             ///< Protects pending
+static std::condition_variable pendingSignal;
+
+static void putLength(std::string& buf, size_t len)
+{
+    do {
+        uint8_t b = len & 0x7f;
+        len >>= 7;
+        buf += (char)(len ? b | 0x80 : b);
+    } while (len);
+}
+
+static void putString(std::string& buf, const char* s, size_t len)
+{
+    buf += (char)(len >> 8);
+    buf += (char)len;
+    buf.append(s, len);
+}
+
+/**
+ * Append a packet consisting of fixed header and the variable part.
+ */
+static void putPacket(std::string& buf, uint8_t type, const std::string& body)
+{
+    buf += (char)type;
+    putLength(buf, body.size());
+    buf += body;
+}
+
+/**
+ * Append a publish of the value. QoS 1 publishes are kept until acknowledged.
+ */
+static void putPublish(std::string& buf, CacheEntry* ce)
+{
+    std::string body;
+    std::string topic = prefix + '/' + ce->path;
+    putString(body, topic.c_str(), topic.size());
+    if (qos > 0) {
+        if (++packetId == 0) packetId = 1;
+        body += (char)(packetId >> 8);
+        body += (char)packetId;
+    }
+    char value[64];
+    body.append(value, formatValue(value, sizeof(value), ce));
+    std::string packet;
+    putPacket(packet, PUBLISH | (qos > 0 ? 0x02 : 0) | (retain ? 0x01 : 0), body);
+    buf += packet;
+    if (qos > 0) {
+        if (inflight.size() >= MAX_INFLIGHT) {
+            logText(1, "mq", "No acknowledge for packet %d, dropped", inflight.front().id);
+            inflight.pop_front();
+        }
+        inflight.push_back({ packetId, packet });
+    }
+}
+
+/**
+ * Append all unacknowledged publishes flagged as duplicates.
+ */
+static void putResend(std::string& buf)
+{
+    for (auto it = inflight.begin(); it != inflight.end(); it++) {
+        it->packet[0] |= DUP;
+        buf += it->packet;
+    }
+}
+
+/**
+ * Forget an acknowledged publish.
+ */
+static void onPuback(uint16_t id)
+{
+    for (auto it = inflight.begin(); it != inflight.end(); it++) {
+        if (it->id == id) {
+            inflight.erase(it);
+            return;
+        }
+    }
+}
+
+static void disconnect()
+{
+    if (fd >= 0) close(fd);
+    fd = -1;
+    received.clear();
+}
+
+/**
+ * Wait for the socket to become ready.
+ * @return True when ready before the timeout.
+ */
+static bool waitFor(short events, int timeout)
+{
+    struct pollfd pfd = { fd, events, 0 };
+    int rc;
+    while ((rc = poll(&pfd, 1, timeout)) < 0 && errno == EINTR);
+    return rc > 0 && (pfd.revents & (events | POLLHUP | POLLERR)) == events;
+}
+
+/**
+ * Send the whole buffer on the non blocking socket.
+ */
+static bool sendAll(const std::string& buf)
+{
+    size_t pos = 0;
+    while (pos < buf.size()) {
+        ssize_t n = send(fd, buf.data() + pos, buf.size() - pos, MSG_NOSIGNAL);
+        if (n > 0) pos += n;
+        else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+        else if (!waitFor(POLLOUT, IO_TIMEOUT)) return false;
+    }
+    return true;
+}
+
+/**
+ * Receive exactly size bytes on the non blocking socket.
+ */
+static bool recvAll(uint8_t* buf, size_t size)
+{
+    size_t pos = 0;
+    while (pos < size) {
+        ssize_t n = recv(fd, buf + pos, size - pos, 0);
+        if (n > 0) pos += n;
+        else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) return false;
+        else if (!waitFor(POLLIN, IO_TIMEOUT)) return false;
+    }
+    return true;
+}
+
+/**
+ * Consume acknowledges and ping responses sent by the broker.
+ * Packets may arrive split, an incomplete packet is kept for the next call.
+ * @return False in case the connection was closed.
+ */
+static bool drain()
+{
+    char buf[256];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) received.append(buf, n);
+    while (received.size() >= 2) {
+        size_t len = 0, pos = 1;
+        for (int shift = 0; pos < received.size() && pos < 5; shift += 7) {
+            uint8_t b = received[pos++];
+            len |= (size_t)(b & 0x7f) << shift;
+            if ((b & 0x80) == 0) break;
+        }
+        if ((received[pos - 1] & 0x80) || received.size() < pos + len) break;     // incomplete
+        if ((uint8_t)received[0] == PUBACK && len == 2) onPuback((uint8_t)received[pos] << 8 | (uint8_t)received[pos + 1]);
+        received.erase(0, pos + len);
+    }
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+/**
+ * Open the socket and send the MQTT connect.
+ */
+static bool connectBroker()
+{
+    struct addrinfo hints = {}, *res = 0;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char service[8];
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host.c_str(), service, &hints, &res) != 0) {
+        logText(1, "mq", "Unknown host %s", host.c_str());
+        return false;
+    }
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        if (connect(fd, res->ai_addr, res->ai_addrlen) < 0 && errno != EINPROGRESS) disconnect();
+    }
+    freeaddrinfo(res);
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (fd < 0 || !waitFor(POLLOUT, IO_TIMEOUT) || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+        logText(1, "mq", "Failed to connect %s:%d", host.c_str(), port);
+        disconnect();
+        return false;
+    }
+    std::string body, buf;
+    putString(body, "MQTT", 4);
+    body += (char)4;            // protocol level 3.1.1
+    body += (char)(qos > 0 ? 0 : 0x02);     // QoS 1 keeps the session for acknowledging resent publishes
+    body += (char)(keepalive >> 8);
+    body += (char)keepalive;
+    putString(body, clientId.c_str(), clientId.size());
+    putPacket(buf, CONNECT, body);
+    uint8_t ack[4];
+    if (!sendAll(buf) || !recvAll(ack, sizeof(ack)) || ack[0] != CONNACK || ack[3] != 0) {
+        logText(1, "mq", "Connect rejected by %s:%d", host.c_str(), port);
+        disconnect();
+        return false;
+    }
+    logText(1, "mq", "Connected to %s:%d", host.c_str(), port);
+    return true;
+}
+
+/**
+ * Change listener collecting the values to be published.
+ */
+static void onChange(CacheEntry* ce)
+{
+    if (ce->slots[0] == ce->slots[1]) return;      // not readable
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    if (pending.insert(ce).second && pending.size() == 1) pendingSignal.notify_one();
+}
+
+/**
+ * Publisher thread. Changes arriving within BATCH_DELAY, e.g. of one refresh cycle, are sent as one batch.
+ */
+static void publishLoop()
+{
+    auto lastSent = std::chrono::steady_clock::now();
+    while (1) {
+        if (fd < 0) {
+            if (!connectBroker()) {
+                std::this_thread::sleep_for(std::chrono::seconds(RECONNECT_DELAY));
+                continue;
+            }
+            republish = true;
+        }
+        std::set<CacheEntry*> batch;
+        {
+            std::unique_lock<std::mutex> lock(pendingMutex);
+            if (pending.empty() && !republish) pendingSignal.wait_for(lock, std::chrono::seconds(keepalive > 1 ? keepalive / 2 : 1));
+            if (!pending.empty()) {
+                lock.unlock();
+                std::this_thread::sleep_for(std::chrono::milliseconds(BATCH_DELAY));
+                lock.lock();
+            }
+            batch.swap(pending);
+        }
+        std::string buf;
+        if (republish) {
+            putResend(buf);
+            for (uint32_t i = ApiRoot->slots[0]; i < ApiRoot->slots[1]; i++) {
+                CacheEntry* ce = leafAt(i);
+                if (ce->block == 0 || ce->updated != 0) putPublish(buf, ce);      // skip values not read so far
+            }
+            republish = false;
+        }
+        else for (auto it = batch.begin(); it != batch.end(); it++) putPublish(buf, *it);
+        if (buf.empty() && keepalive > 0 && std::chrono::steady_clock::now() - lastSent >= std::chrono::seconds(keepalive / 2)) {
+            buf += (char)PINGREQ;
+            buf += (char)0;
+        }
+        if (!buf.empty()) {
+            if (!sendAll(buf)) {
+                logText(1, "mq", "Send failed");
+                disconnect();
+                continue;
+            }
+            logText(3, "mq", "%d bytes published", (int)buf.size());
+            lastSent = std::chrono::steady_clock::now();
+        }
+        if (!drain()) {
+            logText(1, "mq", "Connection closed by broker");
+            disconnect();
+        }
+    }
+}
+
+int mqtt_init(const char* _host, int _port, const char* _clientId, const char* _prefix, int _qos, bool _retain, int _keepalive)
+{
+    host = _host;
+    port = _port;
+    clientId = _clientId;
+    prefix = _prefix;
+    qos = _qos > 0 ? 1 : 0;
+    retain = _retain;
+    keepalive = _keepalive;
+    addChangeListener(onChange);
+    std::thread(publishLoop).detach();
+    return 0;
+}
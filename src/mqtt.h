@@ -0,0 +1,14 @@
+/*
+ * Copyright 2022 Hans Busch
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#pragma once
+#include <stdint.h>
+
+/**
+ * Start publishing value changes to an MQTT broker. Uses a thread of its own.
+ * @param host Broker host name or address
+ * @param prefix Topic prefix. The topic of a value is prefix/path, e.g. viserve/status/temperature/boiler
+ * @param qos Quality of service 0 or 1. QoS 1 publishes are resent until acknowledged.
+ */
+int mqtt_init(const char* host, int port, const char* clientId, const char* prefix, int qos, bool retain, int keepalive);
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2022 Hans Busch
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include "reactor.h"
+#include "vito_io.h"
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#define MAXEVENTS 16
+
+/**
+ * Registered descriptor. Timers consume their expiration count before the handler is called.
+ */
+struct Source {
+    int fd;
+    bool timer;
+    reactorHandler handler;
+    void* ctx;
+};
+static int epfd = -1;
+
+uint64_t monotonicMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+int reactor_init()
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) return logText(0, "ev", "Error creating epoll %s", strerror(errno));
+    return 0;
+}
+
+static int addSource(int fd, bool timer, reactorHandler handler, void* ctx)
+{
+    Source* source = new Source{ fd, timer, handler, ctx };
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = source;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        delete source;
+        return logText(0, "ev", "Error adding %d to epoll %s", fd, strerror(errno));
+    }
+    return 0;
+}
+
+int reactor_add(int fd, reactorHandler handler, void* ctx)
+{
+    return addSource(fd, false, handler, ctx);
+}
+
+int reactor_timer(reactorHandler handler, void* ctx)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) return logText(0, "ev", "Error creating timer %s", strerror(errno));
+    if (addSource(fd, true, handler, ctx)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int reactor_arm(int timer, uint64_t deadline, uint32_t period)
+{
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = deadline / 1000;
+    spec.it_value.tv_nsec = (deadline % 1000) * 1000000;
+    spec.it_interval.tv_sec = period / 1000;
+    spec.it_interval.tv_nsec = (period % 1000) * 1000000;
+    if (timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, 0)) return logText(0, "ev", "Error arming timer %s", strerror(errno));
+    return 0;
+}
+
+void reactor_run()
+{
+    while (1) {
+        struct epoll_event events[MAXEVENTS];
+        int n = epoll_wait(epfd, events, MAXEVENTS, -1);
+        if (n < 0 && errno != EINTR) {
+            logText(0, "ev", "Error waiting for events %s", strerror(errno));
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            Source* source = (Source*)events[i].data.ptr;
+            if (source->timer) {
+                uint64_t expirations;
+                if (read(source->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) continue;    // rearmed meanwhile
+            }
+            source->handler(source->ctx);
+        }
+    }
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2022 Hans Busch
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#pragma once
+#include <stdint.h>
+
+typedef void (*reactorHandler)(void* ctx);
+
+/**
+ * Create the event loop of the main thread serving the housekeeping, GPIO events and the pulse timer.
+ */
+int reactor_init();
+
+/**
+ * Call handler whenever fd is readable. Must be called before reactor_run.
+ */
+int reactor_add(int fd, reactorHandler handler, void* ctx);
+
+/**
+ * Create a timer calling handler once armed and expired.
+ * @return Timer handle or -1 in case of error
+ */
+int reactor_timer(reactorHandler handler, void* ctx);
+
+/**
+ * Arm a timer. May be called from any thread.
+ * @param deadline Expiry in monotonic milliseconds, zero to disarm
+ * @param period Interval in milliseconds for repeating timers, zero for a single expiry
+ */
+int reactor_arm(int timer, uint64_t deadline, uint32_t period);
+
+/**
+ * Dispatch events forever. Handlers must not block. Returns only in case of error.
+ */
+void reactor_run();
+
+/**
+ * Monotonic clock in milliseconds.
+ */
+uint64_t monotonicMs();
@@ -3,77 +3,341 @@
  * SPDX-License-Identifier: GPL-2.0-or-later
  */
 #include "restapi.h"
+#include "history.h"
+#include "vito_io.h"
+#include "reactor.h"
 #include <time.h>
-#include <sstream>
+#include <errno.h>
+#include <string>
 #include <list>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <random>
+#include <atomic>
 
-#define MAXPATH 1024
+#define REFRESH_LEAD 1      ///< Seconds a value is refreshed ahead of its expiry.
+#define MAXBLOCK 120        ///< Longest read supported by a single telegram.
+#define MAXGAP 4            ///< Maximum number of unused bytes read in between two coalesced entries.
+#define SNAPSHOT_MAGIC 0x324e5356   ///< "VSN2"
+
+/**
+ * Contiguous address range fetched with a single read command.
+ * Covers one or more cache entries with neighbouring addresses.
+ */
+struct ReadBlock {
+    uint32_t addr;          // 16 bit start address
+    int len;                // number of bytes covering all entries
+    std::list<CacheEntry*> entries;
+    time_t due;             // scheduled refresh
+    bool urgent;            // requested for a value beyond its stale window, read at read priority
+    time_t grace;           // restored from the snapshot: requests before do not pull the spread refresh forward
+};
+
+/**
+ * Scheduled refresh of a block. Ordered for a min-heap by due time.
+ * Items whose block was rescheduled meanwhile are skipped when popped.
+ */
+struct BlockDue {
+    time_t due;
+    ReadBlock* block;
+    bool operator<(const BlockDue& other) const { return due > other.due; }
+};
+
+/**
+ * Scheduled switch off of a pulse. Ordered for a min-heap by deadline.
+ */
+struct PulseDue {
+    uint64_t deadline;
+    CacheEntry* ce;
+    bool operator<(const PulseDue& other) const { return deadline > other.deadline; }
+};
 static time_t now;
-static restIO readCb, writeCb;
-static std::list<CacheEntry*> timerList;
+static restIO readCb, writeCb, refreshCb;
+static std::list<CacheEntry*> refreshList;     ///< Readable entries served by the Vito interface.
+static std::list<ReadBlock> readBlocks;        ///< Coalesced reads covering refreshList.
+static std::mutex refreshMutex;
+static std::condition_variable refreshSignal;  ///< Wakes the refresh thread for stale entries.
+static std::priority_queue<BlockDue> refreshSchedule;     ///< Due refreshes, protected by refreshMutex
+static std::priority_queue<PulseDue> pulseSchedule;       ///< Running pulses, protected by pulseMutex
+static std::list<CacheEntry*> pulseOffs;       ///< Expired pulses to be switched off by the refresh thread, protected by refreshMutex
+static const char* snapshotFile;
+static int snapshotInterval;
+static int pulseTimer = -1;
+static std::mutex pulseMutex;                  ///< Protects CacheEntry::deadline
+static time_t snapshotDue;
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+/**
+ * Open addressing hash table of all nodes keyed by their full path.
+ */
+struct PathIndex {
+    uint32_t hash;
+    CacheEntry* ce;
+};
+static PathIndex* pathIndex;
+static uint32_t pathMask;
+
+/**
+ * Position in the Json skeleton where the value of a leaf is inserted.
+ */
+struct JsonSlot {
+    uint32_t offset;
+    CacheEntry* ce;
+};
+static std::string skeleton;               ///< Json of the whole api without values
+static std::vector<JsonSlot> jsonSlots;    ///< Value slots in skeleton order
+
+/**
+ * Memoized Json of a node tagged with the version it was rendered for.
+ */
+struct JsonCache {
+    uint32_t version;
+    std::shared_ptr<const std::string> body;    // immutable, shared with responses in flight
+};
+static std::mutex jsonCacheMutex;          ///< Protects CacheEntry::cache
+static std::atomic<uint32_t> versionCounter;
+static uint32_t bootEpoch;                 ///< Random prefix of version tokens, differs per process start
+
+#define MAXWAIT 120         ///< Maximum duration in seconds a long poll request is parked
+/**
+ * Long poll request parked until the node changes.
+ */
+struct Waiter {
+    MHD_Connection* connection;
+    CacheEntry* ce;         // requested node
+    time_t deadline;        // time to answer unchanged
+    bool suspended;         // connection suspended and not yet resumed
+};
+static std::list<Waiter> waiters;
+static std::mutex waiterMutex;             ///< Protects waiters and waitersStopped
+static bool waitersStopped;                ///< Service stops, long polls are answered right away
+static std::list<changeListener> listeners;
 std::list<CacheEntry*> gpioList;
 
 CacheEntry ApiRoot[2];
 /**
- * Recursively convert a cache entry to Json.
+ * Format a leaf value as Json value.
+ * @return Number of characters written.
  */
-static bool getJson(std::stringstream &buf, CacheEntry *ce, char *jpath, char *jcur, char *jmax)
+int formatValue(char* buf, size_t size, CacheEntry* ce)
 {
-    if (ce->children) {
-        buf << '{';
-		bool notFirst = false;
-        for (CacheEntry *c = ce->children; c->name; c++) {
-            if (notFirst) buf << ',';
-            buf << '"' << c->name << "\":";
-            char *jc = jcur + snprintf(jcur, jmax - jcur, ".%s", c->name);
-            notFirst |= getJson(buf, c, jpath, jc, jmax);
+    if (ce->block && ce->updated == 0) return snprintf(buf, size, "null");      // not read from the device so far
+    switch (ce->type) {
+    case Bool:
+        return snprintf(buf, size, "%s", loadValue(ce) ? "true" : "false");
+    case Hex: {
+        int n = snprintf(buf, size, "\"");
+        for (int i = 0; i < ce->len && n + 3 < (int)size; i++) n += snprintf(buf + n, size - n, "%02x", ce->buffer[i]);
+        return n + snprintf(buf + n, size - n, "\"");
+    }
+    default:
+        return snprintf(buf, size, "%g", loadValue(ce) / (double)ce->scale);
+    }
+}
+
+/**
+ * Resume parked long poll requests.
+ * @param ce Changed leaf. Null for resuming requests beyond their deadline.
+ */
+static void resumeWaiters(CacheEntry* ce)
+{
+    std::lock_guard<std::mutex> lock(waiterMutex);
+    time_t now = time(0);
+    for (auto it = waiters.begin(); it != waiters.end(); it++) {
+        if (!it->suspended) continue;
+        bool hit = ce ? ce->slots[0] < ce->slots[1] && ce->slots[0] >= it->ce->slots[0] && ce->slots[0] < it->ce->slots[1]
+                      : it->deadline <= now;
+        if (hit) {
+            it->suspended = false;
+            MHD_resume_connection(it->connection);
         }
-        buf << '}';
-		return notFirst;
     }
-    else if (ce->op != Writeonly) {
-        if (ce->target == Vito && ce->timeout < now) {
-            readCb(ce->addr, ce->buffer, ce->len);
-            if (ce->len == 2) ce->value = ce->val16;        // propagate sign
-            ce->timeout = now + ce->refresh;
-        }
-        switch (ce->type) {
-        case Bool:
-            buf << (ce->value ? "true" : "false");
-            break;
-        case Hex:
-            for (int i = 0; i < ce->len; i++) {
-                char txt[4];
-                snprintf(txt, sizeof(txt), "%02x", ce->buffer[i]);
-                buf << txt;
-            }
-            break;
-        default:
-            buf << (ce->value / (double)ce->scale);
-            break;
+}
+
+void stopWaiters()
+{
+    std::lock_guard<std::mutex> lock(waiterMutex);
+    waitersStopped = true;
+    for (auto it = waiters.begin(); it != waiters.end(); it++) {
+        if (it->suspended) {
+            it->suspended = false;
+            MHD_resume_connection(it->connection);
+        }
+    }
+}
+
+void dropWaiter(MHD_Connection* connection)
+{
+    std::lock_guard<std::mutex> lock(waiterMutex);
+    for (auto it = waiters.begin(); it != waiters.end(); it++) {
+        if (it->connection == connection) {
+            waiters.erase(it);
+            return;
         }
-		return true;
     }
-	return false;
+}
+
+void touchCacheEntry(CacheEntry* ce)
+{
+    ce->version = ++versionCounter;
+    resumeWaiters(ce);
+    for (auto it = listeners.begin(); it != listeners.end(); it++) (*it)(ce);
+}
+
+void addChangeListener(changeListener cb)
+{
+    listeners.push_back(cb);
+}
+
+CacheEntry* leafAt(uint32_t slot)
+{
+    return jsonSlots[slot].ce;
 }
 
 /**
- * Recursive lookup of a cache entry from the path
+ * Parse a version token "epoch-version" as sent in the ETag.
+ * @return False if the token was issued before a restart or is invalid.
  */
-CacheEntry *lookup(const char *path, CacheEntry *ce)
+static bool parseVersion(const char* token, uint32_t& version)
 {
-    const char *end = strchr(path, '/');
-    if (end == 0) end = path + strlen(path);
-    for (CacheEntry *c = ce->children; c->name; c++) {
-        if (strlen(c->name) == end - path && !memcmp(c->name, path, end - path)) {
-            if (*end == 0 || end[1] == 0) return c;
-            if (c->children) return lookup(end + 1, c);
-            return 0;
-        }
+    char* end;
+    if (strtoul(token, &end, 16) != bootEpoch || *end != '-') return false;
+    version = (uint32_t)strtoul(end + 1, 0, 16);
+    return true;
+}
+
+/**
+ * Version of a node, i.e. the latest version of all its leafs.
+ */
+uint32_t nodeVersion(CacheEntry* ce)
+{
+    uint32_t version = 0;
+    for (uint32_t i = ce->slots[0]; i < ce->slots[1]; i++) {
+        if (jsonSlots[i].ce->version > version) version = jsonSlots[i].ce->version;
+    }
+    return version;
+}
+
+/**
+ * Park a long poll request until the node changed from the version known to the client
+ * or the wait time elapsed. Called again when libmicrohttpd resumes the connection.
+ * @return True in case the connection got suspended.
+ */
+static bool waitForChange(MHD_Connection* connection, CacheEntry* ce, uint32_t since, int wait)
+{
+    std::lock_guard<std::mutex> lock(waiterMutex);
+    auto it = waiters.begin();
+    while (it != waiters.end() && it->connection != connection) it++;
+    if (waitersStopped || nodeVersion(ce) != since || (it != waiters.end() && it->deadline <= time(0))) {
+        if (it != waiters.end()) waiters.erase(it);
+        return false;
+    }
+    if (it == waiters.end()) {
+        if (wait <= 0) return false;
+        if (wait > MAXWAIT) wait = MAXWAIT;
+        waiters.push_back(Waiter{ connection, ce, time(0) + wait, false });
+        it = --waiters.end();
+    }
+    it->suspended = true;
+    MHD_suspend_connection(connection);
+    return true;
+}
+
+/**
+ * Fetch all values of a node as needed.
+ * @param updated Oldest update time of all device values included, values not read so far are skipped.
+ * @return Version of the node.
+ */
+static uint32_t fetchJson(CacheEntry* ce, time_t& updated)
+{
+    for (uint32_t i = ce->slots[0]; i < ce->slots[1]; i++) {
+        CacheEntry* c = jsonSlots[i].ce;
+        fetchCacheEntry(c);
+        if (c->block && c->updated && (updated == 0 || c->updated < updated)) updated = c->updated;
+    }
+    return nodeVersion(ce);
+}
+
+/**
+ * Render the Json of a node by patching the current values into its skeleton.
+ */
+static void getJson(std::string& buf, CacheEntry* ce)
+{
+    buf.clear();
+    uint32_t pos = ce->json[0];
+    for (uint32_t i = ce->slots[0]; i < ce->slots[1]; i++) {
+        CacheEntry* c = jsonSlots[i].ce;
+        buf.append(skeleton, pos, jsonSlots[i].offset - pos);
+        pos = jsonSlots[i].offset;
+        char txt[2 * sizeof(c->buffer) + 3];
+        buf.append(txt, formatValue(txt, sizeof(txt), c));
+    }
+    buf.append(skeleton, pos, ce->json[1] - pos);
+}
+
+#if MHD_VERSION >= 0x00097300
+static void releaseBody(void* body)
+{
+    delete (std::shared_ptr<const std::string>*)body;
+}
+
+MHD_Response* createResponse(const std::shared_ptr<const std::string>& body)
+{
+    auto ref = new std::shared_ptr<const std::string>(body);
+    auto response = MHD_create_response_from_buffer_with_free_callback_cls(body->size(), body->data(), &releaseBody, ref);
+    if (!response) delete ref;
+    return response;
+}
+#else
+MHD_Response* createResponse(const std::shared_ptr<const std::string>& body)
+{
+    return MHD_create_response_from_buffer(body->size(), (void*)body->data(), MHD_RESPMEM_MUST_COPY);
+}
+#endif
+
+/**
+ * Lookup of a cache entry from the path using the path index.
+ * The path is hashed in a single pass, a trailing slash is ignored.
+ */
+CacheEntry *lookup(const char *path)
+{
+    uint32_t hash = FNV_OFFSET;
+    const char *p = path;
+    for (; *p && !(p[0] == '/' && p[1] == 0); p++) hash = (hash ^ (uint8_t)*p) * FNV_PRIME;
+    size_t len = p - path;
+    for (uint32_t i = hash & pathMask; pathIndex[i].ce; i = (i + 1) & pathMask) {
+        CacheEntry *ce = pathIndex[i].ce;
+        if (pathIndex[i].hash == hash && ce->path[len] == 0 && !memcmp(ce->path, path, len)) return ce;
     }
     return 0;
 }
 
+/**
+ * Earliest deadline of all running pulses, 0 if none. Drops superseded deadlines.
+ */
+static uint64_t nextPulse()
+{
+    while (!pulseSchedule.empty() && pulseSchedule.top().ce->deadline != pulseSchedule.top().deadline) pulseSchedule.pop();
+    return pulseSchedule.empty() ? 0 : pulseSchedule.top().deadline;
+}
+
+/**
+ * Schedule the switch off of a pulse written just now.
+ */
+static void startPulse(CacheEntry* ce)
+{
+    std::lock_guard<std::mutex> lock(pulseMutex);
+    ce->deadline = monotonicMs() + ce->refresh * 1000;
+    pulseSchedule.push({ ce->deadline, ce });
+    if (pulseTimer >= 0) reactor_arm(pulseTimer, nextPulse(), 0);
+}
+
 /**
  * Handler for serving rest GET and PUT calls.
  * GET uses GetJson for returning simple and complex items.
@@ -81,7 +345,15 @@ CacheEntry *lookup(const char *path, CacheEntry *ce)
  */
 MHD_Result onRestApi(struct MHD_Connection *connection, const char *url, bool write, const char *data, size_t *dataSize)
 {
-    CacheEntry *ce = strlen(url) <= 5 ? ApiRoot : lookup(url + 5, ApiRoot);
+    CacheEntry *ce = (url[4] == 0 || url[5] == 0) ? ApiRoot : lookup(url + 5);
+    if (!ce && !write) {
+        const char *suffix = strrchr(url, '/');
+        if (suffix && suffix > url + 4 && !strcmp(suffix, "/history")) {
+            ce = lookup(std::string(url + 5, suffix).c_str());
+            if (ce && !ce->children) return onHistory(connection, ce);
+            ce = 0;
+        }
+    }
     if (!ce) {
         const char* fault = "<html><body>Resource not found</body></html>";
         auto response = MHD_create_response_from_buffer(strlen(fault), (void*)fault, MHD_RESPMEM_PERSISTENT);
@@ -89,7 +361,9 @@ MHD_Result onRestApi(struct MHD_Connection *connection, const char *url, bool wr
         MHD_destroy_response(response);
         return ret;
     }
-	std::stringstream sbuf;
+    std::shared_ptr<const std::string> body;
+    time_t updated = 0;
+    char etag[24] = "";
     now = time(0);
     if (!write) {
         if (ce->op == Writeonly) {
@@ -99,8 +373,30 @@ MHD_Result onRestApi(struct MHD_Connection *connection, const char *url, bool wr
             MHD_destroy_response(response);
             return ret;
         }
-		char jpathbuf[MAXPATH];     ///< Must be larger than longest possible path.
-		getJson(sbuf, ce, jpathbuf, jpathbuf, jpathbuf + sizeof(jpathbuf));
+        uint32_t version = fetchJson(ce, updated);
+        auto wait = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "wait");
+        auto since = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "since");
+        uint32_t sinceVersion;
+        bool current = since && parseVersion(since, sinceVersion);    // token of this process start
+        if (wait && current && waitForChange(connection, ce, sinceVersion, atoi(wait))) return MHD_YES;
+        snprintf(etag, sizeof(etag), "\"%x-%x\"", bootEpoch, version);
+        auto match = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_NONE_MATCH);
+        if ((match && !strcmp(match, etag)) || (current && sinceVersion == version)) {
+            auto response = MHD_create_response_from_buffer(0, 0, MHD_RESPMEM_PERSISTENT);
+            MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, etag);
+            auto ret = MHD_queue_response(connection, MHD_HTTP_NOT_MODIFIED, response);
+            MHD_destroy_response(response);
+            return ret;
+        }
+        std::lock_guard<std::mutex> lock(jsonCacheMutex);
+        if (ce->cache == 0) ce->cache = new JsonCache();
+        if (!ce->cache->body || ce->cache->version != version) {
+            auto json = std::make_shared<std::string>();
+            getJson(*json, ce);
+            ce->cache->body = json;
+            ce->cache->version = version;
+        }
+        body = ce->cache->body;
 	}
 	else {
         if (*dataSize > 0) {
@@ -140,15 +436,21 @@ MHD_Result onRestApi(struct MHD_Connection *connection, const char *url, bool wr
             }
             if (writeCb(ce->addr, (uint8_t*)&ival, ce->len) == 0) {
                 memcpy(ce->buffer, &ival, ce->len);              // simulate by writing to cache
+                touchCacheEntry(ce);
             }
 
-            if (ce->op == Writeonly) ce->timeout = now + ce->refresh;
+            if (ce->pulse) startPulse(ce);
             *dataSize = 0;      // libmicrohttpd needs this to allow sending response in next call!
             return MHD_YES;
         }
 	}
-    struct MHD_Response * response = MHD_create_response_from_buffer(sbuf.str().length(),
-        (void*)sbuf.str().c_str(), MHD_RESPMEM_MUST_COPY);
+    struct MHD_Response * response = body ? createResponse(body) : MHD_create_response_from_buffer(0, 0, MHD_RESPMEM_PERSISTENT);
+    if (updated) {
+        char age[24];
+        snprintf(age, sizeof(age), "%ld", (long)(updated < now ? now - updated : 0));
+        MHD_add_response_header(response, MHD_HTTP_HEADER_AGE, age);
+    }
+    if (*etag) MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, etag);
     auto ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
     MHD_destroy_response(response);
 
@@ -203,6 +505,7 @@ static void loadApi(CacheEntry* ce, const pugi::xml_node& node, int defaultRefre
         ce->len = node.attribute("len").as_int(len);
         auto op = node.attribute("operation").as_string();
         ce->refresh = node.attribute("refresh").as_int(defaultRefresh);
+        ce->stale = node.attribute("stale").as_int((int)ce->refresh);
         ce->op = Readonly;
         if (op) {
             switch (op[0]) {
@@ -217,39 +520,371 @@ static void loadApi(CacheEntry* ce, const pugi::xml_node& node, int defaultRefre
                 auto duration = node.attribute("duration");
                 if (duration) {
                     ce->refresh = duration.as_int();
-                    timerList.push_back(ce);
+                    ce->pulse = ce->refresh > 0;
                 }
                 break;
             }
             }
         }
+        auto history = node.attribute("history").as_uint(0);
+        auto persist = node.attribute("persist").as_uint(0);
+        if (history > 0 || persist > 0) ce->history = history_create(ce, history, persist);
         int gpio = node.attribute("gpio").as_int(-1);
         if (gpio >= 0) {
             ce->addr = gpio;
             ce->target = node.attribute("frequency") ? GPIO_Frequency : GPIO_Counter;
+            ce->offset = ce->target == GPIO_Counter ? node.attribute("offset").as_int(-1) : -1;
             gpioList.push_back(ce);
         }
+        else if (ce->op != Writeonly) refreshList.push_back(ce);
+    }
+}
+
+/**
+ * Assign the full path to a node and all its children.
+ * @return Number of nodes
+ */
+static size_t assignPath(CacheEntry* ce, const char* parent)
+{
+    if (parent == 0) ce->path = "";
+    else {
+        char* path = (char*)malloc(strlen(parent) + strlen(ce->name) + 2);
+        sprintf(path, *parent ? "%s/%s" : "%s%s", parent, ce->name);
+        ce->path = path;
     }
+    size_t n = 1;
+    if (ce->children) for (CacheEntry* c = ce->children; c->name; c++) n += assignPath(c, ce->path);
+    return n;
 }
 
-void loadRestApi(CacheEntry* ce, const pugi::xml_node& node, int defaultRefresh, restIO read, restIO write)
+static void indexPath(CacheEntry* ce)
+{
+    uint32_t hash = FNV_OFFSET;
+    for (const char* p = ce->path; *p; p++) hash = (hash ^ (uint8_t)*p) * FNV_PRIME;
+    uint32_t i = hash & pathMask;
+    while (pathIndex[i].ce) i = (i + 1) & pathMask;
+    pathIndex[i].hash = hash;
+    pathIndex[i].ce = ce;
+    if (ce->children) for (CacheEntry* c = ce->children; c->name; c++) indexPath(c);
+}
+
+/**
+ * Compile the api tree into the path index. The table is kept at most half full.
+ */
+static void buildIndex(CacheEntry* root)
+{
+    size_t n = assignPath(root, 0);
+    uint32_t size = 16;
+    while (size < 2 * n) size <<= 1;
+    pathIndex = (PathIndex*)calloc(size, sizeof(PathIndex));
+    pathMask = size - 1;
+    indexPath(root);
+}
+
+/**
+ * Render the structural Json of a node and its children once. Values are left out and
+ * recorded as slots, write only leafs are skipped.
+ */
+static void compileJson(CacheEntry* ce)
+{
+    ce->json[0] = (uint32_t)skeleton.size();
+    ce->slots[0] = (uint32_t)jsonSlots.size();
+    if (ce->children) {
+        skeleton += '{';
+        bool notFirst = false;
+        for (CacheEntry* c = ce->children; c->name; c++) {
+            if (!c->children && c->op == Writeonly) continue;
+            if (notFirst) skeleton += ',';
+            skeleton += '"';
+            skeleton += c->name;
+            skeleton += "\":";
+            compileJson(c);
+            notFirst = true;
+        }
+        skeleton += '}';
+    }
+    else if (ce->op != Writeonly) {
+        jsonSlots.push_back(JsonSlot{ (uint32_t)skeleton.size(), ce });
+    }
+    ce->json[1] = (uint32_t)skeleton.size();
+    ce->slots[1] = (uint32_t)jsonSlots.size();
+}
+
+/**
+ * Group readable entries by address into blocks which are fetched with a single read.
+ * An entry joins the previous block when the block stays within maxBlock bytes and
+ * not more than MAXGAP unused bytes are read in between.
+ */
+static void planBlocks(int maxBlock)
+{
+    if (maxBlock > MAXBLOCK) maxBlock = MAXBLOCK;
+    std::vector<CacheEntry*> sorted(refreshList.begin(), refreshList.end());
+    std::stable_sort(sorted.begin(), sorted.end(), [](CacheEntry* a, CacheEntry* b) { return a->addr < b->addr; });
+    ReadBlock* block = 0;
+    for (auto it = sorted.begin(); it != sorted.end(); it++) {
+        CacheEntry* ce = *it;
+        int end = ce->addr + ce->len;
+        if (block == 0 || ce->addr > block->addr + block->len + MAXGAP || end - (int)block->addr > maxBlock) {
+            readBlocks.emplace_back();
+            block = &readBlocks.back();
+            block->addr = ce->addr;
+            block->len = ce->len;
+        }
+        if (end - (int)block->addr > block->len) block->len = end - block->addr;
+        block->entries.push_back(ce);
+        ce->block = block;
+    }
+}
+
+void loadRestApi(CacheEntry* ce, const pugi::xml_node& node, int defaultRefresh, int maxBlock, restIO read, restIO write, restIO refresh)
 {
     readCb = read;
     writeCb = write;
+    refreshCb = refresh;
+    bootEpoch = std::random_device()() ^ (uint32_t)time(0);
     loadApi(ce, node, defaultRefresh);
+    buildIndex(ce);
+    compileJson(ce);
+    planBlocks(maxBlock);
+}
+
+/**
+ * Earliest timeout of all entries covered by a block.
+ */
+static time_t blockTimeout(ReadBlock* block)
+{
+    time_t timeout = block->entries.front()->timeout;
+    for (auto it = block->entries.begin(); it != block->entries.end(); it++) {
+        if ((*it)->timeout < timeout) timeout = (*it)->timeout;
+    }
+    return timeout;
 }
 
 /**
- * Check for any pending pulse to be switched off
+ * Schedule the next refresh of a block shortly before the first of its entries expires.
+ */
+static void scheduleBlock(ReadBlock* block)
+{
+    std::lock_guard<std::mutex> lock(refreshMutex);
+    block->due = blockTimeout(block) - REFRESH_LEAD;
+    refreshSchedule.push({ block->due, block });
+}
+
+/**
+ * Read a block from the device and distribute the content to the covered entries.
+ * The values are assembled in a local copy so that concurrent readers of the cache
+ * never observe a partial update.
+ */
+static void refreshBlock(ReadBlock* block, restIO read)
+{
+    uint8_t buffer[MAXBLOCK];
+    for (auto it = block->entries.begin(); it != block->entries.end(); it++) {     // simulation mode leaves the buffer untouched
+        memcpy(buffer + (*it)->addr - block->addr, (*it)->buffer, (*it)->len);
+    }
+    bool ok = read(block->addr, buffer, block->len) >= 0;
+    time_t now = time(0);
+    for (auto it = block->entries.begin(); it != block->entries.end(); it++) {
+        CacheEntry* ce = *it;
+        uint8_t value[sizeof(ce->buffer)];
+        memcpy(value, ce->buffer, sizeof(value));
+        memcpy(value, buffer + ce->addr - block->addr, ce->len);
+        if (ce->len == 2) *(int32_t*)value = *(int16_t*)value;        // propagate sign
+        bool changed = memcmp(ce->buffer, value, sizeof(value)) != 0;
+        bool first = ok && ce->updated == 0;      // served as null so far
+        if (changed) memcpy(ce->buffer, value, sizeof(value));
+        ce->timeout = now + ce->refresh;
+        if (ok) ce->updated = now;
+        if (changed || first) touchCacheEntry(ce);
+    }
+    scheduleBlock(block);
+}
+
+void fetchCacheEntry(CacheEntry* ce)
+{
+    time_t now = time(0);
+    if (ce->block == 0 || ce->timeout >= now) return;
+    if (ce->timeout != 0 && ce->block->grace > now) return;     // restored, refreshed on its startup schedule
+    std::lock_guard<std::mutex> lock(refreshMutex);
+    if (ce->timeout == 0 || ce->timeout + ce->stale < now) ce->block->urgent = true;
+    if (ce->block->due > now) {     // pull the refresh of the block forward
+        ce->block->due = now;
+        refreshSchedule.push({ now, ce->block });
+    }
+    refreshSignal.notify_one();
+}
+
+/**
+ * Background refresh loop. Reads the block due next shortly before one of its entries expires
+ * and sleeps until then, so http handlers only serve from the cache.
+ * Expired pulses are switched off first.
+ */
+static void refreshLoop()
+{
+    std::unique_lock<std::mutex> lock(refreshMutex);
+    while (1) {
+        while (!refreshSchedule.empty() && refreshSchedule.top().due != refreshSchedule.top().block->due) refreshSchedule.pop();
+        time_t now = time(0);
+        if (!pulseOffs.empty()) {
+            CacheEntry* ce = pulseOffs.front();
+            pulseOffs.pop_front();
+            lock.unlock();
+            uint32_t off = 0;
+            writeCb(ce->addr, &off, ce->len);
+            lock.lock();
+        }
+        else if (refreshSchedule.empty()) refreshSignal.wait(lock);
+        else if (refreshSchedule.top().due > now) refreshSignal.wait_for(lock, std::chrono::seconds(refreshSchedule.top().due - now));
+        else {
+            ReadBlock* block = refreshSchedule.top().block;
+            refreshSchedule.pop();
+            restIO read = block->urgent ? readCb : refreshCb;
+            block->urgent = false;
+            lock.unlock();
+            refreshBlock(block, read);
+            lock.lock();
+        }
+    }
+}
+
+void startRestRefresh()
+{
+    for (auto it = readBlocks.begin(); it != readBlocks.end(); it++) {
+        if (it->due) {              // restored from the snapshot
+            std::lock_guard<std::mutex> lock(refreshMutex);
+            refreshSchedule.push({ it->due, &*it });
+        }
+        else scheduleBlock(&*it);
+    }
+    std::thread(refreshLoop).detach();
+}
+
+/**
+ * Write all values read so far to the snapshot file. The file is replaced atomically.
+ * Each record holds the path, the time of the last update and the value buffer.
+ */
+static int saveSnapshot(const char* file)
+{
+    std::string tmp = std::string(file) + ".tmp";
+    FILE* fd = fopen(tmp.c_str(), "wb");
+    if (fd == 0) return logText(0, "sn", "Error writing %s %s", tmp.c_str(), strerror(errno));
+    uint32_t magic = SNAPSHOT_MAGIC;
+    fwrite(&magic, sizeof(magic), 1, fd);
+    for (auto it = jsonSlots.begin(); it != jsonSlots.end(); it++) {
+        CacheEntry* ce = it->ce;
+        if (ce->block ? ce->updated == 0 : ce->target != GPIO_Counter) continue;    // never read or frequency
+        uint16_t len = (uint16_t)strlen(ce->path);
+        int64_t updated = ce->updated;
+        fwrite(&len, sizeof(len), 1, fd);
+        fwrite(ce->path, 1, len, fd);
+        fwrite(&updated, sizeof(updated), 1, fd);
+        fwrite(ce->buffer, sizeof(ce->buffer), 1, fd);
+    }
+    bool ok = !ferror(fd);
+    if (fclose(fd) || !ok || rename(tmp.c_str(), file)) return logText(0, "sn", "Error writing %s %s", file, strerror(errno));
+    return 0;
+}
+
+/**
+ * Restore the values of a snapshot. Restored device values expire as if they were read at their
+ * original update time. The background refreshes are spread over the refresh interval so the serial
+ * line is not flooded at startup. Within the stale window after startup requests do not pull them
+ * forward, afterwards a request for a value not yet refreshed has it read right away.
+ */
+static int loadSnapshot(const char* file)
+{
+    FILE* fd = fopen(file, "rb");
+    if (fd == 0) return logText(1, "sn", "No snapshot %s", file);
+    uint32_t magic = 0;
+    if (fread(&magic, sizeof(magic), 1, fd) != 1 || magic != SNAPSHOT_MAGIC) {
+        fclose(fd);
+        return logText(0, "sn", "Invalid snapshot %s", file);
+    }
+    int n = 0;
+    uint16_t len;
+    std::string path;
+    int64_t updated;
+    uint8_t buffer[sizeof(ApiRoot->buffer)];
+    while (fread(&len, sizeof(len), 1, fd) == 1 && (path.resize(len), fread(&path[0], 1, len, fd) == len)
+        && fread(&updated, sizeof(updated), 1, fd) == 1 && fread(buffer, sizeof(buffer), 1, fd) == 1) {
+        CacheEntry* ce = lookup(path.c_str());
+        if (ce == 0 || ce->children || ce->op == Writeonly || (ce->block == 0 && ce->target != GPIO_Counter)) continue;
+        memcpy(ce->buffer, buffer, sizeof(buffer));
+        ce->updated = (time_t)updated;
+        n++;
+    }
+    fclose(fd);
+    time_t now = time(0);
+    size_t k = 0, count = readBlocks.size();
+    for (auto it = readBlocks.begin(); it != readBlocks.end(); it++, k++) {
+        bool restored = true;
+        time_t stale = it->entries.front()->stale;
+        for (auto ce = it->entries.begin(); ce != it->entries.end(); ce++) {
+            if ((*ce)->updated) (*ce)->timeout = (*ce)->updated + (*ce)->refresh;
+            else restored = false;
+            if ((*ce)->stale < stale) stale = (*ce)->stale;
+        }
+        if (restored) {
+            it->due = now + (time_t)(k * it->entries.front()->refresh / count);
+            it->grace = now + stale;
+        }
+    }
+    logText(0, "sn", "Restored %d values from %s", n, file);
+    return 0;
+}
+
+void initSnapshot(const char* file, int interval)
+{
+    snapshotFile = file;
+    snapshotInterval = interval;
+    snapshotDue = time(0) + interval;
+    loadSnapshot(file);
+}
+
+/**
+ * Hand all pulses past their deadline to the refresh thread for switching off and arm the timer
+ * for the next one. Never writes the device, the timer shares its thread with the GPIO events.
+ */
+static void onPulseTimer(void*)
+{
+    uint64_t now = monotonicMs();
+    std::list<CacheEntry*> expired;
+    {
+        std::lock_guard<std::mutex> lock(pulseMutex);
+        uint64_t next;
+        while ((next = nextPulse()) && next <= now) {
+            CacheEntry* ce = pulseSchedule.top().ce;
+            pulseSchedule.pop();
+            ce->deadline = 0;
+            expired.push_back(ce);
+        }
+        if (pulseTimer >= 0) reactor_arm(pulseTimer, next, 0);
+    }
+    if (expired.empty()) return;
+    std::lock_guard<std::mutex> lock(refreshMutex);
+    pulseOffs.splice(pulseOffs.end(), expired);
+    refreshSignal.notify_one();
+}
+
+void startPulseTimer()
+{
+    pulseTimer = reactor_timer(onPulseTimer, 0);
+}
+
+/**
+ * Check for long poll requests beyond their deadline and for pending pulses unless
+ * they are handled by the pulse timer.
  */
 void onRestTimer()
+{
+    if (pulseTimer < 0) onPulseTimer(0);
+    resumeWaiters(0);
+}
+
+void syncSnapshot()
 {
     auto now = time(0);
-    uint32_t off = 0;
-    for (auto it = timerList.begin(); it != timerList.end(); it++) {
-        if ((*it)->timeout && (*it)->timeout < now) {
-            (*it)->timeout = 0;
-            writeCb((*it)->addr, &off, (*it)->len);
-        }
+    if (snapshotFile && snapshotInterval > 0 && now >= snapshotDue) {
+        snapshotDue = now + snapshotInterval;
+        saveSnapshot(snapshotFile);
     }
 }
@@ -7,15 +7,21 @@
 #include "pugixml/pugixml.hpp"
 #include <stdint.h>
 #include <list>
+#include <string>
+#include <memory>
 
 enum Type { Int, Half, Deci, Centi, Milli, Bool, Hex };
 enum Operation { Readonly, ReadWrite, Writeonly };
 enum Target {Vito, GPIO_Counter, GPIO_Frequency};
+struct ReadBlock;
+struct JsonCache;
+struct History;
 /**
  * Serves as binary representation of the REST api and as cache.
  */
 struct CacheEntry {
     const char *name;       // Name of the entity
+    const char *path;       // Full path below the api root, e.g. status/temperature/boiler
     time_t refresh;         // Caching duration. Time in seconds until the value needs to be read from the device. Stores pulse duration for write only.
     CacheEntry *children;   // Child nodes.
     uint32_t addr;          // 16 bit address
@@ -27,20 +33,96 @@ struct CacheEntry {
         int16_t val16;          // Value in little endian matching the API transmission order
         int32_t value;          // Value in little endian matching the API transmission order
         uint8_t buffer[16]; // Buffer size should be sufficient to cache data
-        struct {
-            uint64_t val64;
-            uint64_t lastTs;    // last timestamp in milli seconds for duration estimation
-        };
     };
     time_t timeout;         // time until the current value is valid
+    time_t stale;           // Seconds the value is still served after timeout while being refreshed in the background
+    time_t updated;         // time of the last successful read from the device
     int len;                // command length
+    ReadBlock *block;       // Coalesced read covering this entry. Null if not read from the Vito.
+    uint32_t json[2];       // Byte range of the node within the pre-rendered Json skeleton
+    uint32_t slots[2];      // Range of value slots within the skeleton
+    uint32_t version;       // Global change counter at the last change of the value
+    JsonCache *cache;       // Memoized Json of the node
+    History *history;       // Recent value changes. Null if not configured.
+    int offset;             // Slot of a GPIO counter in the persistent counter file, -1 if not configured
+    bool pulse;             // Switched off refresh seconds after each write
+    uint64_t deadline;      // Monotonic milliseconds a running pulse is switched off, 0 if none
 };
+/**
+ * Read the value of an entry. Values updated outside the refresh thread are published atomically.
+ */
+#ifdef _WIN32
+inline int32_t loadValue(const CacheEntry* ce) { return *(volatile const int32_t*)&ce->value; }
+#else
+inline int32_t loadValue(const CacheEntry* ce) { return __atomic_load_n(&ce->value, __ATOMIC_ACQUIRE); }
+#endif
 extern CacheEntry ApiRoot[2];
 extern std::list<CacheEntry*> gpioList;
 
 typedef int (*restIO)(int addr, void* buffer, size_t size);
+typedef void (*changeListener)(CacheEntry* ce);
 
 MHD_Result onRestApi(struct MHD_Connection *connection, const char *url, bool write, const char *data, size_t *dataSize);
-void loadRestApi(CacheEntry* ce, const pugi::xml_node& node, int defaultRefresh, restIO read, restIO write);
+void loadRestApi(CacheEntry* ce, const pugi::xml_node& node, int defaultRefresh, int maxBlock, restIO read, restIO write, restIO refresh);
 void onRestTimer();
-CacheEntry* lookup(const char* path, CacheEntry* ce);
+/**
+ * Forget a parked long poll request. Must be called when libmicrohttpd completes the connection.
+ */
+void dropWaiter(MHD_Connection* connection);
+/**
+ * Answer all parked long poll requests and park no further ones. Must be called before stopping libmicrohttpd.
+ */
+void stopWaiters();
+/**
+ * Switch off pulses exactly at their deadline via a reactor timer instead of the once a second check.
+ */
+void startPulseTimer();
+/**
+ * Restore the cache from a snapshot file and write it every interval seconds.
+ * Must be called after loadRestApi and before serving starts.
+ */
+void initSnapshot(const char* file, int interval);
+/**
+ * Write the snapshot once the interval passed. Blocks on file I/O, must not be called by the event thread.
+ */
+void syncSnapshot();
+/**
+ * Start the background thread keeping all device values in the cache up to date.
+ */
+void startRestRefresh();
+/**
+ * Request a refresh of an expired entry by the refresh thread. Never reads the device,
+ * the caller serves the cached value or null for values not read so far.
+ */
+void fetchCacheEntry(CacheEntry* ce);
+/**
+ * Mark the value of an entry as changed. Assigns a new version and informs all listeners.
+ */
+void touchCacheEntry(CacheEntry* ce);
+/**
+ * Register a callback for value changes. Must be called before serving starts.
+ * Callbacks are invoked on the thread changing the value.
+ */
+void addChangeListener(changeListener cb);
+/**
+ * Leaf at a value slot. The leafs of a node are found in the slot range CacheEntry::slots.
+ */
+CacheEntry* leafAt(uint32_t slot);
+/**
+ * Version of a node, i.e. the latest version of all its leafs. Changes whenever a value of the node changes.
+ */
+uint32_t nodeVersion(CacheEntry* ce);
+/**
+ * Format a leaf value as Json value.
+ * @return Number of characters written.
+ */
+int formatValue(char* buf, size_t size, CacheEntry* ce);
+/**
+ * Create a response on the body without copying it. The reference is released once libmicrohttpd is done.
+ * libmicrohttpd before 0.9.73 lacks the free callback with closure, the body is copied then.
+ */
+MHD_Response* createResponse(const std::shared_ptr<const std::string>& body);
+/**
+ * Lookup of a cache entry by its path below the api root.
+ */
+CacheEntry* lookup(const char* path);
@@ -0,0 +1,178 @@
+/*
+ * Copyright 2022 Hans Busch
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include "restapi.h"
+#include <time.h>
+#include <string>
+#include <list>
+#include <mutex>
+
+#define RING_SIZE 8192      ///< Per connection event buffer. Must be a power of two.
+#define PING_INTERVAL 15    ///< Seconds between keep alive comments on idle streams
+
+/**
+ * Server sent event stream of a single connection.
+ * Starts with the current value of every leaf followed by the changes.
+ */
+struct EventStream {
+    MHD_Connection* connection;
+    CacheEntry* ce;         // subscribed node
+    uint32_t cursor;        // next leaf slot of the initial values
+    uint32_t head, tail;    // ring positions, wrap with RING_SIZE
+    time_t lastSent;
+    bool suspended;         // waiting for events
+    bool overflow;          // events were lost, stream is terminated
+    char ring[RING_SIZE];
+};
+static std::list<EventStream*> streams;
+static std::mutex streamMutex;     ///< Protects streams and their content
+static bool stopping;              ///< Service stops, streams end once their events are sent
+
+/**
+ * Format the event for a leaf. Paths are not limited in length, hence the event is built in a string.
+ */
+static void formatEvent(std::string& event, CacheEntry* ce)
+{
+    char value[2 * sizeof(ce->buffer) + 3];
+    event.assign("data: {\"").append(ce->path).append("\":");
+    event.append(value, formatValue(value, sizeof(value), ce));
+    event.append("}\n\n");
+}
+
+static void push(EventStream* s, const char* data, int len)
+{
+    if (s->head - s->tail + len > RING_SIZE) {
+        s->overflow = true;
+        return;
+    }
+    for (int i = 0; i < len; i++) s->ring[(s->head + i) & (RING_SIZE - 1)] = data[i];
+    s->head += len;
+}
+
+static void wakeup(EventStream* s)
+{
+    if (s->suspended) {
+        s->suspended = false;
+        MHD_resume_connection(s->connection);
+    }
+}
+
+/**
+ * Change listener queuing the event to all streams subscribed to a parent of the leaf.
+ */
+static void onChange(CacheEntry* ce)
+{
+    if (ce->slots[0] == ce->slots[1]) return;      // not part of any Json
+    std::string event;
+    std::lock_guard<std::mutex> lock(streamMutex);
+    for (auto it = streams.begin(); it != streams.end(); it++) {
+        EventStream* s = *it;
+        if (ce->slots[0] < s->ce->slots[0] || ce->slots[0] >= s->ce->slots[1]) continue;
+        if (event.empty()) formatEvent(event, ce);
+        push(s, event.data(), (int)event.size());
+        wakeup(s);
+    }
+}
+
+/**
+ * Content reader of libmicrohttpd. Suspends the connection while there is nothing to send.
+ */
+static ssize_t readStream(void* cls, uint64_t pos, char* buf, size_t max)
+{
+    (void)pos;          // events are not addressable, the stream is only read forward
+    EventStream* s = (EventStream*)cls;
+    std::lock_guard<std::mutex> lock(streamMutex);
+    size_t n = 0;
+    while (s->cursor < s->ce->slots[1]) {
+        std::string event;
+        formatEvent(event, leafAt(s->cursor));
+        if (n + event.size() > max) break;
+        memcpy(buf + n, event.data(), event.size());
+        n += event.size();
+        s->cursor++;
+    }
+    if (s->overflow) return n ? (ssize_t)n : MHD_CONTENT_READER_END_OF_STREAM;
+    while (n < max && s->tail != s->head) buf[n++] = s->ring[s->tail++ & (RING_SIZE - 1)];
+    if (n == 0) {
+        if (stopping) return MHD_CONTENT_READER_END_OF_STREAM;
+        s->suspended = true;
+        MHD_suspend_connection(s->connection);
+    }
+    else s->lastSent = time(0);
+    return n;
+}
+
+static void freeStream(void* cls)
+{
+    EventStream* s = (EventStream*)cls;
+    std::lock_guard<std::mutex> lock(streamMutex);
+    streams.remove(s);
+    delete s;
+}
+
+void initStream()
+{
+    addChangeListener(onChange);
+}
+
+/**
+ * End all streams. libmicrohttpd must not be stopped with suspended connections.
+ */
+void stopStreams()
+{
+    std::lock_guard<std::mutex> lock(streamMutex);
+    stopping = true;
+    for (auto it = streams.begin(); it != streams.end(); it++) wakeup(*it);
+}
+
+/**
+ * Send a keep alive comment on idle streams. Detects closed connections as well.
+ */
+void onStreamTimer()
+{
+    time_t now = time(0);
+    std::lock_guard<std::mutex> lock(streamMutex);
+    for (auto it = streams.begin(); it != streams.end(); it++) {
+        EventStream* s = *it;
+        if (s->suspended && s->lastSent + PING_INTERVAL <= now) {
+            push(s, ":\n\n", 3);
+            wakeup(s);
+        }
+    }
+}
+
+/**
+ * Handler for GET /api/stream/<path> returning a text/event-stream of value changes.
+ */
+MHD_Result onStream(struct MHD_Connection* connection, const char* url)
+{
+    CacheEntry* ce = (url[0] == 0 || url[1] == 0) ? ApiRoot : lookup(url + 1);
+    if (!ce || ce->slots[0] == ce->slots[1]) {
+        const char* fault = "<html><body>Resource not found</body></html>";
+        auto response = MHD_create_response_from_buffer(strlen(fault), (void*)fault, MHD_RESPMEM_PERSISTENT);
+        auto ret = MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, response);
+        MHD_destroy_response(response);
+        return ret;
+    }
+    for (uint32_t i = ce->slots[0]; i < ce->slots[1]; i++) fetchCacheEntry(leafAt(i));
+    EventStream* s = new EventStream();
+    s->connection = connection;
+    s->ce = ce;
+    s->cursor = ce->slots[0];
+    s->lastSent = time(0);
+    auto response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 1024, &readStream, s, &freeStream);
+    if (response == NULL) {
+        delete s;
+        return MHD_NO;
+    }
+    {
+        std::lock_guard<std::mutex> lock(streamMutex);
+        streams.push_back(s);
+    }
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "text/event-stream");
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+    auto ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+    return ret;
+}
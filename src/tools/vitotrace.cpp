@@ -0,0 +1,134 @@
+/*
+ * Copyright 2022 Hans Busch
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * Decoder of the binary Optolink trace written by viserve.
+ * Usage: vitotrace [-s] file
+ * Prints all records as text or with -s the latency and error statistics per address.
+ */
+#include "../trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <map>
+
+/**
+ * Exchanges of an address from the first telegram sent until the response.
+ */
+struct Stats {
+    uint32_t count;
+    uint32_t naks;
+    uint64_t min, max, sum;     // latency of successful exchanges in microseconds
+    uint32_t ok;
+    std::map<int, uint32_t> errors;
+};
+
+static const char* dirName(uint8_t dir)
+{
+    static const char* names[] = { "open", "tx", "nak", "rx" };
+    return dir < sizeof(names) / sizeof(names[0]) ? names[dir] : "?";
+}
+
+static void printRecord(const TraceRecord* r, int64_t offset, bool anchored)
+{
+    if (anchored) {
+        uint64_t us = r->ts + offset;
+        time_t sec = (time_t)(us / 1000000);
+        char txt[32];
+        strftime(txt, sizeof(txt), "%Y-%m-%d %H:%M:%S", localtime(&sec));
+        printf("%s.%06u", txt, (unsigned)(us % 1000000));
+    }
+    else printf("+%.6f", r->ts / 1e6);
+    printf(" %-4s %04x %4d ", dirName(r->dir), r->addr, r->result);
+    if (r->dir != TRACE_OPEN) for (int i = 0; i < r->len; i++) printf("%02x", r->data[i]);
+    printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+    bool stats = argc > 1 && !strcmp(argv[1], "-s");
+    if (argc != (stats ? 3 : 2)) {
+        fprintf(stderr, "Usage: %s [-s] file\n", argv[0]);
+        return 1;
+    }
+    FILE* fd = fopen(argv[argc - 1], "rb");
+    if (fd == 0) {
+        perror(argv[argc - 1]);
+        return 1;
+    }
+    TraceHeader h;
+    if (fread(&h, sizeof(h), 1, fd) != 1 || h.magic != TRACE_MAGIC || h.head >= h.capacity || h.tail >= h.capacity) {
+        fprintf(stderr, "No trace file\n");
+        fclose(fd);
+        return 1;
+    }
+    std::vector<uint8_t> ring(h.capacity);
+    if (fread(ring.data(), 1, h.capacity, fd) != h.capacity) {
+        fprintf(stderr, "Truncated trace file\n");
+        fclose(fd);
+        return 1;
+    }
+    fclose(fd);
+
+    int64_t offset = 0;         // wall clock minus monotonic clock of the current session
+    bool anchored = false;
+    std::map<uint16_t, Stats> perAddr;
+    uint64_t started = 0;       // first telegram sent of the pending exchange
+    for (uint32_t pos = h.tail; pos != h.head;) {
+        const TraceRecord* r = (const TraceRecord*)&ring[pos];
+        if (r->size == 0) {         // continues at the start
+            pos = 0;
+            continue;
+        }
+        if (r->size < sizeof(TraceRecord) || pos + r->size > h.capacity) {
+            fprintf(stderr, "Corrupt record at %u\n", pos);
+            return 1;
+        }
+        pos = (pos + r->size) % h.capacity;
+        if (r->dir == TRACE_OPEN) {
+            uint64_t wall;
+            memcpy(&wall, r->data, sizeof(wall));
+            offset = (int64_t)(wall - r->ts);
+            anchored = true;
+            started = 0;
+        }
+        if (!stats) {
+            printRecord(r, offset, anchored);
+            continue;
+        }
+        Stats& s = perAddr[r->addr];
+        switch (r->dir) {
+        case TRACE_TX:
+            if (started == 0) started = r->ts;
+            break;
+        case TRACE_NAK:
+            s.naks++;
+            break;
+        case TRACE_RX:
+            s.count++;
+            if (r->result < 0) s.errors[r->result]++;
+            else if (started) {
+                uint64_t latency = r->ts - started;
+                if (s.ok == 0 || latency < s.min) s.min = latency;
+                if (latency > s.max) s.max = latency;
+                s.sum += latency;
+                s.ok++;
+            }
+            started = 0;
+            break;
+        }
+    }
+    if (stats) {
+        printf("addr  count  naks  min_ms  avg_ms  max_ms errors\n");
+        for (auto it = perAddr.begin(); it != perAddr.end(); it++) {
+            Stats& s = it->second;
+            if (s.count == 0) continue;
+            printf("%04x %6u %5u %7.1f %7.1f %7.1f", it->first, s.count, s.naks,
+                s.min / 1e3, s.ok ? s.sum / 1e3 / s.ok : 0, s.max / 1e3);
+            for (auto e = s.errors.begin(); e != s.errors.end(); e++) printf(" %d:%u", e->first, e->second);
+            printf("\n");
+        }
+    }
+    return 0;
+}
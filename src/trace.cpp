@@ -0,0 +1,89 @@
+/*
+ * Copyright 2022 Hans Busch
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include "trace.h"
+#include "vito_io.h"
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static TraceHeader* header;     ///< Mapped file, null if tracing is off
+static uint8_t* ring;
+
+static uint64_t usNow(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+int trace_open(const char* file, uint32_t size)
+{
+    size &= ~7u;
+    if (size < 1024) return logText(0, "tr", "Trace size %u too small", size);
+    int fd = open(file, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(TraceHeader) + size) < 0) {
+        if (fd >= 0) close(fd);
+        return logText(0, "tr", "Error opening %s %s", file, strerror(errno));
+    }
+    void* map = mmap(0, sizeof(TraceHeader) + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return logText(0, "tr", "Error mapping %s %s", file, strerror(errno));
+    TraceHeader* h = (TraceHeader*)map;
+    if (h->magic != TRACE_MAGIC || h->capacity != size || h->head >= size || h->tail >= size || (h->head | h->tail) & 7) {
+        memset(h, 0, sizeof(TraceHeader));
+        h->magic = TRACE_MAGIC;
+        h->capacity = size;
+    }
+    ring = (uint8_t*)(h + 1);
+    header = h;
+    uint64_t wall = usNow(CLOCK_REALTIME);
+    trace_frame(TRACE_OPEN, 0, 0, &wall, sizeof(wall));
+    return 0;
+}
+
+/**
+ * Release the oldest record. Also skips a wrap marker.
+ */
+static void dropOldest()
+{
+    TraceRecord* r = (TraceRecord*)(ring + header->tail);
+    uint32_t tail = r->size ? header->tail + r->size : 0;
+    if (tail >= header->capacity) tail = 0;
+    header->tail = tail;
+}
+
+/**
+ * Free bytes behind head, keeping 8 bytes so a full ring is distinguished from an empty one.
+ */
+static uint32_t space()
+{
+    return (header->tail + header->capacity - header->head - 8) % header->capacity;
+}
+
+void trace_frame(TraceDir dir, int addr, int result, const void* data, size_t len)
+{
+    if (header == 0) return;
+    uint32_t size = (uint32_t)(sizeof(TraceRecord) + len + 7) & ~7u;
+    if (header->head == header->tail) header->head = header->tail = 0;
+    uint32_t skip = header->head + size > header->capacity ? header->capacity - header->head : 0;     // rest of the ring
+    while (header->head != header->tail && space() < skip + size) dropOldest();
+    if (header->head == header->tail) header->head = header->tail = skip = 0;
+    if (skip) {
+        ((TraceRecord*)(ring + header->head))->size = 0;       // continue at the start
+        header->head = 0;
+    }
+    TraceRecord* r = (TraceRecord*)(ring + header->head);
+    r->dir = (uint8_t)dir;
+    r->result = (int8_t)result;
+    r->addr = (uint16_t)addr;
+    r->len = (uint16_t)len;
+    r->ts = usNow(CLOCK_MONOTONIC);
+    memcpy(r->data, data, len);
+    r->size = (uint16_t)size;
+    header->head = (header->head + size) % header->capacity;
+}
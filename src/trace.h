@@ -0,0 +1,49 @@
+/*
+ * Copyright 2022 Hans Busch
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Binary trace of the Optolink traffic. The file starts with a TraceHeader followed by
+ * a ring of variable length records. Records between tail and head are valid, a record
+ * with size zero continues at the start of the ring.
+ */
+#define TRACE_MAGIC 0x31525456     ///< "VTR1"
+
+enum TraceDir {
+    TRACE_OPEN = 0,     // trace opened, data holds the wall clock in microseconds
+    TRACE_TX = 1,       // telegram sent
+    TRACE_NAK = 2,      // no acknowledge, result holds the byte received or -1
+    TRACE_RX = 3,       // response received, result holds the vito_io return code
+};
+
+struct TraceHeader {
+    uint32_t magic;
+    uint32_t capacity;      // bytes of the ring following the header
+    uint32_t head;          // offset of the next record written
+    uint32_t tail;          // offset of the oldest record
+    uint8_t pad[48];
+};
+
+struct TraceRecord {
+    uint16_t size;          // bytes of the record including data, multiple of 8
+    uint8_t dir;            // TraceDir
+    int8_t result;
+    uint16_t addr;
+    uint16_t len;           // bytes of data
+    uint64_t ts;            // monotonic clock in microseconds
+    uint8_t data[];
+};
+
+/**
+ * Map the trace file. A file of different size is reinitialized.
+ */
+int trace_open(const char* file, uint32_t size);
+
+/**
+ * Append a record. Must only be called by the I/O worker. Does nothing unless opened.
+ */
+void trace_frame(TraceDir dir, int addr, int result, const void* data, size_t len);
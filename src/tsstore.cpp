@@ -0,0 +1,259 @@
+/*
+ * Copyright 2022 Hans Busch
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include "tsstore.h"
+#include "vito_io.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define TS_MAGIC 0x32535456     ///< "VTS2"
+#define TS_RECORD 128           ///< Record size in bytes
+#define TS_BITS ((TS_RECORD - 12) * 8)
+
+/**
+ * File header followed by the record being filled and the ring of records.
+ */
+struct TsHeader {
+    uint32_t magic;
+    uint16_t recordSize;
+    uint16_t reserved;
+    uint32_t capacity;      // number of records
+    uint32_t head;          // next record written
+    uint32_t count;         // valid records
+    uint8_t pad[44];
+};
+
+/**
+ * Fixed size record holding a compressed run of samples. The first sample is stored plain,
+ * subsequent ones as delta of delta of the timestamp and XOR of the value.
+ */
+struct TsRecord {
+    uint32_t t0;
+    int32_t v0;
+    uint16_t n;             // number of samples including the first
+    uint16_t bits;          // used bits of data
+    uint8_t data[TS_RECORD - 12];
+};
+
+struct TsStore {
+    TsHeader* header;       // mapped file
+    TsRecord* current;      // mapped record being filled, not yet part of the ring
+    TsRecord* records;      // mapped ring
+    uint32_t lastT;
+    int32_t lastDelta;
+    int32_t lastV;
+};
+
+static void resume(TsStore* s);
+
+TsStore* tsstore_open(const char* file, uint32_t records)
+{
+    size_t size = sizeof(TsHeader) + (size_t)(records + 1) * sizeof(TsRecord);
+    int fd = open(file, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        logText(0, "ts", "Error opening %s %s", file, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    void* map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        logText(0, "ts", "Error mapping %s %s", file, strerror(errno));
+        return 0;
+    }
+    TsStore* store = (TsStore*)calloc(1, sizeof(TsStore));
+    store->header = (TsHeader*)map;
+    store->current = (TsRecord*)(store->header + 1);
+    store->records = store->current + 1;
+    TsHeader* h = store->header;
+    if (h->magic != TS_MAGIC || h->recordSize != TS_RECORD || h->capacity != records || h->head >= records || h->count > records
+        || store->current->bits > TS_BITS) {
+        memset(h, 0, sizeof(TsHeader));
+        memset(store->current, 0, sizeof(TsRecord));
+        h->magic = TS_MAGIC;
+        h->recordSize = TS_RECORD;
+        h->capacity = records;
+    }
+    resume(store);
+    return store;
+}
+
+static void putBits(TsRecord* r, uint64_t value, int n)
+{
+    while (n-- > 0) {
+        if ((value >> n) & 1) r->data[r->bits >> 3] |= 0x80 >> (r->bits & 7);
+        r->bits++;
+    }
+}
+
+static uint64_t getBits(const TsRecord* r, uint32_t& pos, int n)
+{
+    uint64_t value = 0;
+    while (n-- > 0) {
+        value = (value << 1) | ((r->data[pos >> 3] >> (7 - (pos & 7))) & 1);
+        pos++;
+    }
+    return value;
+}
+
+static int timeBits(int64_t dod)
+{
+    if (dod == 0) return 1;
+    if (dod >= -64 && dod < 64) return 2 + 7;
+    if (dod >= -2048 && dod < 2048) return 3 + 12;
+    if (dod >= -(1 << 19) && dod < (1 << 19)) return 4 + 20;
+    return 4 + 32;
+}
+
+static void putTime(TsRecord* r, int64_t dod)
+{
+    switch (timeBits(dod)) {
+    case 1: putBits(r, 0, 1); break;
+    case 9: putBits(r, 0x2, 2); putBits(r, dod, 7); break;
+    case 15: putBits(r, 0x6, 3); putBits(r, dod, 12); break;
+    case 24: putBits(r, 0xe, 4); putBits(r, dod, 20); break;
+    default: putBits(r, 0xf, 4); putBits(r, dod, 32); break;
+    }
+}
+
+static int64_t signExtend(uint64_t value, int n)
+{
+    return (int64_t)(value << (64 - n)) >> (64 - n);
+}
+
+static int64_t getTime(const TsRecord* r, uint32_t& pos)
+{
+    if (getBits(r, pos, 1) == 0) return 0;
+    if (getBits(r, pos, 1) == 0) return signExtend(getBits(r, pos, 7), 7);
+    if (getBits(r, pos, 1) == 0) return signExtend(getBits(r, pos, 12), 12);
+    if (getBits(r, pos, 1) == 0) return signExtend(getBits(r, pos, 20), 20);
+    return signExtend(getBits(r, pos, 32), 32);
+}
+
+static int valueBits(uint32_t x)
+{
+    if (x == 0) return 1;
+    return 1 + 5 + 5 + 32 - __builtin_clz(x) - __builtin_ctz(x);
+}
+
+static void putValue(TsRecord* r, uint32_t x)
+{
+    if (x == 0) {
+        putBits(r, 0, 1);
+        return;
+    }
+    int lz = __builtin_clz(x), tz = __builtin_ctz(x), len = 32 - lz - tz;
+    putBits(r, 1, 1);
+    putBits(r, lz, 5);
+    putBits(r, len - 1, 5);
+    putBits(r, x >> tz, len);
+}
+
+static uint32_t getValue(const TsRecord* r, uint32_t& pos)
+{
+    if (getBits(r, pos, 1) == 0) return 0;
+    int lz = (int)getBits(r, pos, 5);
+    int len = (int)getBits(r, pos, 5) + 1;
+    return (uint32_t)getBits(r, pos, len) << (32 - lz - len);
+}
+
+/**
+ * Continue the record being filled before the restart by restoring the state of its last sample.
+ */
+static void resume(TsStore* s)
+{
+    const TsRecord* r = s->current;
+    uint32_t pos = 0;
+    int64_t t = r->t0, delta = 0;
+    uint32_t v = (uint32_t)r->v0;
+    for (uint32_t i = 1; i < r->n; i++) {
+        delta += getTime(r, pos);
+        t += delta;
+        v ^= getValue(r, pos);
+    }
+    s->lastT = (uint32_t)t;
+    s->lastDelta = (int32_t)delta;
+    s->lastV = (int32_t)v;
+}
+
+/**
+ * Move the completed record into the ring.
+ */
+static void persist(TsStore* s)
+{
+    TsHeader* h = s->header;
+    memcpy(&s->records[h->head], s->current, sizeof(TsRecord));
+    h->head = (h->head + 1) % h->capacity;
+    if (h->count < h->capacity) h->count++;
+}
+
+void tsstore_append(TsStore* s, uint32_t ts, int32_t value)
+{
+    TsRecord* r = s->current;
+    int64_t delta = (int64_t)ts - s->lastT;
+    int64_t dod = delta - s->lastDelta;
+    uint32_t x = (uint32_t)(value ^ s->lastV);
+    if (r->n > 0 && (r->n == 0xffff || r->bits + timeBits(dod) + valueBits(x) > TS_BITS)) {
+        persist(s);
+        r->n = 0;
+    }
+    if (r->n == 0) {
+        memset(r, 0, sizeof(TsRecord));
+        r->t0 = ts;
+        r->v0 = value;
+        delta = 0;
+    }
+    else {
+        putTime(r, dod);
+        putValue(r, x);
+    }
+    r->n++;
+    s->lastT = ts;
+    s->lastDelta = (int32_t)delta;
+    s->lastV = value;
+}
+
+/**
+ * Decode a record and collect the samples in range.
+ */
+static void decode(const TsRecord* r, uint32_t from, uint32_t to, std::vector<uint32_t>& ts, std::vector<int32_t>& value)
+{
+    uint32_t pos = 0;
+    int64_t t = r->t0, delta = 0;
+    uint32_t v = (uint32_t)r->v0;
+    for (uint32_t i = 0; i < r->n; i++) {
+        if (i > 0) {
+            delta += getTime(r, pos);
+            t += delta;
+            v ^= getValue(r, pos);
+        }
+        if (t >= to) return;
+        if (t < from) {         // keep only the last sample before the range
+            if (!ts.empty() && ts.back() < from) {
+                ts.back() = (uint32_t)t;
+                value.back() = (int32_t)v;
+                continue;
+            }
+        }
+        ts.push_back((uint32_t)t);
+        value.push_back((int32_t)v);
+    }
+}
+
+void tsstore_read(TsStore* s, uint32_t from, uint32_t to, std::vector<uint32_t>& ts, std::vector<int32_t>& value)
+{
+    TsHeader* h = s->header;
+    for (uint32_t i = 0; i < h->count; i++) {
+        const TsRecord* r = &s->records[(h->head + h->capacity - h->count + i) % h->capacity];
+        const TsRecord* next = i + 1 < h->count ? &s->records[(h->head + h->capacity - h->count + i + 1) % h->capacity] : s->current;
+        if (r->t0 >= to) return;
+        if (next->n > 0 && next->t0 <= from) continue;     // range starts in a later record
+        decode(r, from, to, ts, value);
+    }
+    if (s->current->n > 0) decode(s->current, from, to, ts, value);
+}
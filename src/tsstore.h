@@ -0,0 +1,27 @@
+/*
+ * Copyright 2022 Hans Busch
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+struct TsStore;
+
+/**
+ * Open or create a memory mapped time series file with a fixed number of records.
+ * A file with different layout is reinitialized, otherwise the record being filled is continued.
+ * @return Null in case of error.
+ */
+TsStore* tsstore_open(const char* file, uint32_t records);
+
+/**
+ * Append a sample. Samples are compressed into the current record which lives in the mapping
+ * as well and is moved into the ring once it is full.
+ */
+void tsstore_append(TsStore* store, uint32_t ts, int32_t value);
+
+/**
+ * Decode the samples in the range from to to, preceded by the last sample before from.
+ */
+void tsstore_read(TsStore* store, uint32_t from, uint32_t to, std::vector<uint32_t>& ts, std::vector<int32_t>& value);
@@ -10,12 +10,18 @@
 #include <time.h>
 #include <stdint.h>
 #include "vito_io.h"
+#include "trace.h"
 #include <mutex>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include <list>
 
 #ifndef _WIN32
 #  include <termios.h>
 #  include <sys/ioctl.h>
 #  include <unistd.h>
+#  include <poll.h>
 void msleep(uint32_t t) { usleep(t * 1000); }
 #else
 #  include <io.h>
@@ -26,8 +32,74 @@ extern "C" {
 #define tcflush(x,y) 
 #endif
 
-static int fd_serial = -1;
-static std::mutex ioMutex;  // protects IO
+#define FRAME_TIMEOUT 500   ///< Response time in ms granted to the Vito per telegram
+#define BYTE_TIME 3         ///< Transmission time in ms per byte at 4800 baud 8E2 including margin
+#define SYNC_TIMEOUT 3000   ///< Time in ms to wait for the 0x05 sync byte sent every two seconds in KW mode
+
+static int fd_serial = -1;     // owned by the I/O worker once started
+
+static uint8_t rxRing[256];         // receive ring buffer, indices wrap with uint8_t arithmetic
+static uint8_t rxHead, rxTail;
+
+static uint64_t msNow()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Drop pending input and output, including bytes already buffered in the receive ring.
+ */
+static void rxFlush()
+{
+    tcflush(fd_serial, TCIOFLUSH);
+    rxHead = rxTail = 0;
+}
+
+/**
+ * Get the next received byte. Refills the ring with all bytes available in a single read.
+ * @return Byte value or -1 in case nothing arrived until the deadline.
+ */
+static int rxByte(uint64_t deadline)
+{
+#ifndef _WIN32
+    while (rxHead == rxTail) {
+        uint64_t now = msNow();
+        if (now >= deadline) return -1;
+        struct pollfd pfd = { fd_serial, POLLIN, 0 };
+        int rc = poll(&pfd, 1, (int)(deadline - now));
+        if (rc < 0 && errno != EINTR) return -1;
+        if (rc <= 0) continue;
+        size_t space = (rxHead >= rxTail) ? sizeof(rxRing) - rxHead : (size_t)(rxTail - rxHead);
+        if ((uint8_t)(rxHead + space) == rxTail) space--;       // keep one slot free to tell full from empty
+        ssize_t n = read(fd_serial, rxRing + rxHead, space);
+        if (n < 0 && errno != EINTR && errno != EAGAIN) return -1;
+        if (n > 0) rxHead += (uint8_t)n;
+    }
+    return rxRing[rxTail++];
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Incrementally parse a 0x41 telegram from the receive ring.
+ * @return Telegram length field. Negative in case of error.
+ */
+static int rxTelegram(uint8_t* cmd, size_t size, uint64_t deadline)
+{
+    int byte = rxByte(deadline);
+    if (byte != 0x41) return -3;
+    cmd[0] = (uint8_t)byte;
+    byte = rxByte(deadline);
+    if (byte < 0 || byte > (int)size - 3) return -4;
+    cmd[1] = (uint8_t)byte;
+    int rlen = cmd[1];
+    for (int i = 0; i < rlen + 1; i++) {
+        if ((byte = rxByte(deadline)) < 0) return -5;
+        cmd[i + 2] = (uint8_t)byte;
+    }
+    return rlen;
+}
 
 int vito_open(char *device)
 {
@@ -41,7 +113,8 @@ int vito_open(char *device)
     struct termios tcattr = {};
     tcattr.c_iflag = IGNBRK | IGNPAR;
     tcattr.c_cflag = (CLOCAL | HUPCL | B4800 | CS8 | CREAD | PARENB | CSTOPB);
-    tcattr.c_cc[VTIME] = 50; // RX timeout
+    tcattr.c_cc[VTIME] = 0;  // non blocking reads, timeouts are handled via poll
+    tcattr.c_cc[VMIN] = 0;
      
     if ( tcsetattr(fd_serial, TCSAFLUSH, &tcattr) < 0 ) {
         return logText(0, "init", "Error configuring device %s\n%s", device, strerror(errno));
@@ -60,10 +133,23 @@ int vito_open(char *device)
 #endif
 }
 
+/**
+ * Log a byte received by rxByte, or the timeout.
+ */
+static void logByte(int rec)
+{
+    if (rec < 0) {
+        logText(4, "RD", "timeout");
+        return;
+    }
+    uint8_t byte = (uint8_t)rec;
+    logDump(4, "RD", 0, &byte, 1);
+}
+
 int vito_init( void )
 {
     int trys;
-    uint8_t rec;
+    int rec;
     const uint8_t initKw[] = { 0x04 };
     const uint8_t initSeq[] = { 0x16, 0x00, 0x00 };
    
@@ -74,21 +160,22 @@ int vito_init( void )
             return logText(0, "init", "Reset to KW protocol failed");
         }
 
-        tcflush( fd_serial, TCIOFLUSH );
+        rxFlush();
         logDump(4, "WR", 0, initKw, 1);
         write( fd_serial, initKw, 1 );
         msleep( 200 );
-        tcflush( fd_serial, TCIFLUSH );
-        read( fd_serial, &rec, 1 );    // wait for 0x05
-        logDump(4, "RD", 0, &rec, 1);
+        rxFlush();
+        rec = rxByte(msNow() + SYNC_TIMEOUT);    // wait for 0x05
+        logByte(rec);
     }
     while ( rec != 0x05 );
    
     logDump(4, "WR", 0, initSeq, 3);
     write( fd_serial, initSeq, 3 );
 
-    read( fd_serial, &rec, 1 );
-    logDump(4, "RD", 0, &rec, 1);
+    rec = rxByte(msNow() + FRAME_TIMEOUT);
+    logByte(rec);
+    if (rec < 0) return logText(0, "init", "No response");
     if (rec != 0x06) {
         return logText(0, "init", "Unexpected resp %02x", rec);
     }
@@ -119,8 +206,6 @@ enum VITO_RW {
  */
 static int vito_io(int addr, VITO_RW rw, void* vbuffer, size_t len)
 {
-    std::lock_guard<std::mutex> lock(ioMutex);
-
     uint8_t* buffer = (uint8_t*)vbuffer;
 
     if (fd_serial < 0) {
@@ -147,46 +232,115 @@ static int vito_io(int addr, VITO_RW rw, void* vbuffer, size_t len)
     cmd[7 + writeLen] = vito_crc(cmd);
 
     int retries = 3;
-    uint8_t byte;
+    uint64_t deadline;
     do {
         logDump(4, "WR", 0, cmd, 8 + writeLen);
 
-        tcflush(fd_serial, TCIOFLUSH);
+        rxFlush();
+        trace_frame(TRACE_TX, addr, 0, cmd, 8 + writeLen);
         if (write(fd_serial, cmd, 8 + writeLen) < 8 + writeLen) return -1;
+        deadline = msNow() + FRAME_TIMEOUT + (8 + writeLen + 8 + len) * BYTE_TIME;     // request, ack and response
 
-        if (read(fd_serial, &byte, 1) == 1 && byte == 6) break;
+        int byte = rxByte(deadline);
+        if (byte == 6) break;
+        trace_frame(TRACE_NAK, addr, byte, 0, 0);
         if (byte == 5) {     // wrong mode => try to re-init
             vito_init();
         }
-        if (--retries < 0) return -2;
+        if (--retries < 0) {
+            trace_frame(TRACE_RX, addr, -2, 0, 0);
+            return -2;
+        }
     } while (1);
 
-    if (read(fd_serial, &byte, 1) < 1 || byte != 0x41) return -3;
-    if (read(fd_serial, cmd+1, 1) < 1 || cmd[1] > sizeof(cmd) - 3) return -4;
-    int rlen = cmd[1];
-    for (int i = 0; i < rlen + 1; i++) {
-        if (read(fd_serial, &cmd[i + 2], 1) < 1) return -5;
+    int rlen = rxTelegram(cmd, sizeof(cmd), deadline);
+    if (rlen < 0) {
+        trace_frame(TRACE_RX, addr, rlen, 0, 0);
+        return rlen;
     }
     logDump(4, "RD", 0, cmd, rlen + 3);
 
-    if (vito_crc(cmd) != cmd[rlen + 2]) return -6;
+    if (vito_crc(cmd) != cmd[rlen + 2]) {
+        trace_frame(TRACE_RX, addr, -6, cmd, rlen + 3);
+        return -6;
+    }
+    trace_frame(TRACE_RX, addr, rlen, cmd, rlen + 3);
 
     if (rw == VITO_READ) memcpy(buffer, cmd + 7, len);
 
     return rlen;
 }
 
+/**
+ * Telegram queued for the I/O worker.
+ */
+struct VitoJob {
+    int addr;
+    VITO_RW rw;
+    void* buffer;
+    size_t size;
+    std::promise<int> result;
+};
+
+static std::list<VitoJob> jobQueue[VITO_PRIO_BACKGROUND + 1];     // one queue per priority class
+static std::mutex queueMutex;           // protects jobQueue
+static std::condition_variable queueSignal;
+static std::once_flag workerStarted;
+
+/**
+ * Single thread owning the serial port. Always serves the most urgent job first.
+ */
+static void ioWorker()
+{
+    while (1) {
+        std::list<VitoJob> job;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueSignal.wait(lock, [] {
+                for (auto& q : jobQueue) if (!q.empty()) return true;
+                return false;
+            });
+            for (auto& q : jobQueue) {
+                if (!q.empty()) {
+                    job.splice(job.begin(), q, q.begin());
+                    break;
+                }
+            }
+        }
+        VitoJob& j = job.front();
+        int ret = vito_io(j.addr, j.rw, j.buffer, j.size);
+        if (ret < 0) logText(1, j.rw == VITO_WRITE ? "tx" : "rx", "%04x Error %d", j.addr, ret);
+        j.result.set_value(ret);
+    }
+}
+
+std::future<int> vito_submit(int addr, bool write, void* buffer, size_t size, VitoPriority prio)
+{
+    std::call_once(workerStarted, [] { std::thread(ioWorker).detach(); });
+    std::lock_guard<std::mutex> lock(queueMutex);
+    auto& q = jobQueue[prio];
+    q.emplace_back();
+    VitoJob& j = q.back();
+    j.addr = addr;
+    j.rw = write ? VITO_WRITE : VITO_READ;
+    j.buffer = buffer;
+    j.size = size;
+    auto future = j.result.get_future();
+    queueSignal.notify_one();
+    return future;
+}
+
 int vito_read(int addr, void* buffer, size_t size)
 {
-    int ret = vito_io(addr, VITO_READ, buffer, size);
-    if (ret < 0) logText(1, "rx", "%04x Error %d", addr, ret);
-    return ret;
+    return vito_submit(addr, false, buffer, size, VITO_PRIO_READ).get();
 }
 
 int vito_write(int addr, void* buffer, size_t size)
 {
-    int ret = vito_io(addr, VITO_WRITE, buffer, size);
-    if (ret < 0) logText(1, "tx", "%04x Error %d", addr, ret);
-    return ret;
+    return vito_submit(addr, true, buffer, size, VITO_PRIO_WRITE).get();
 }
 
+int vito_refresh(int addr, void* buffer, size_t size)
+{
+    return vito_submit(addr, false, buffer, size, VITO_PRIO_BACKGROUND).get();
+}
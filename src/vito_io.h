@@ -3,13 +3,31 @@
  * SPDX-License-Identifier: GPL-2.0-or-later
  */
 #include <stdint.h>
+#include <stddef.h>
+#include <future>
+
+/**
+ * Priority classes of the I/O queue. Lower values are served first.
+ */
+enum VitoPriority {
+    VITO_PRIO_WRITE,        // interactive writes
+    VITO_PRIO_READ,         // interactive reads
+    VITO_PRIO_BACKGROUND    // cache refresh
+};
 
 int vito_open(char *device);
 
 int vito_init( void );
 
+/**
+ * Queue a read or write for the I/O worker owning the serial port.
+ * The buffer must stay valid until the returned future is ready.
+ */
+std::future<int> vito_submit(int addr, bool write, void* buffer, size_t size, VitoPriority prio);
+
 int vito_read(int addr, void* buffer, size_t size);
 int vito_write(int addr, void* buffer, size_t size);
+int vito_refresh(int addr, void* buffer, size_t size);     // background priority read
 
 int logText(int level, const char* prefix, const char* fmt, ...);
 void logDump(int level, const char* prefix, int addr, const void* data, size_t size);
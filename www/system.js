@@ -2,6 +2,7 @@ var svg;
 var config;
 var state;
 var requestCirc;
+var version;
 function initSystem()
 {
 	var svgo = document.getElementById('system'); 
@@ -18,12 +19,15 @@ function initSystem()
 }
 function poll() {
     $.ajax({
-        url: "/api/status",
+        url: version === undefined ? "/api/status" : "/api/status?wait=30&since=" + version,
         type: "GET",
         dataType: "json",
-        complete: setTimeout(function() {poll()}, 2000),
-        timeout: 2000
-    }).done(function(data) {
+        timeout: 35000
+    }).done(function(data, status, xhr) {
+		var etag = xhr.getResponseHeader('ETag');
+		if (etag) version = etag.replace(/"/g, '');
+		setTimeout(poll, 0);
+		if (!data) return;		// unchanged
 		state = data;
 		if (state["temperature"] !== undefined && state["pump"] !== undefined) {
 			svg.getElementById('pump-loader').style.fill= state.pump.water ? '#0f0' :'#fff'; 
@@ -38,5 +42,8 @@ function poll() {
 				svg.getElementById('circ-arrow').style.fill='#000'; 
 			}
 		}
+	}).fail(function() {
+		version = undefined;
+		setTimeout(poll, 2000);
 	});
 }